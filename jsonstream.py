@@ -0,0 +1,186 @@
+"""Reading a JSON object while it is still arriving.
+
+A Scanner is fed the text of one JSON object a piece at a time, as it
+comes off the socket, and returns what it has completed so far: each
+element of one array member (for a GitHub push, 'commits') as soon as
+its closing bracket arrives, and every other member whole.
+
+    scanner = jsonstream.Scanner('commits')
+    for data in chunks:
+        for kind, key, value in scanner.feed(data):
+            ...
+    scanner.close()
+
+Each element and member is handed to json.loads on its own, so only
+the one being read is held.  Nothing is checked beyond what json.loads
+checks of the pieces, and the brackets that find them; close() says
+whether the object was finished.
+
+A FormField does the same for a form-urlencoded body: fed the body a
+piece at a time, it returns the decoded bytes of one field, for a
+Scanner, without waiting for the rest.
+"""
+
+import json
+import re
+import urllib
+
+# what changes the scanner's state, outside strings and inside them
+_SPECIAL = re.compile(r'["{}\[\],:]')
+_IN_STRING = re.compile(r'["\\]')
+
+class Scanner(object):
+    """Finds the members of a JSON object, and the elements of its
+    array member named array, as each one is completed."""
+
+    def __init__(self, array):
+        self.array = array
+        self.buf = ''
+        self.pos = 0            # how far into buf has been scanned
+        self.depth = 0          # brackets open at pos
+        self.in_string = False
+        self.key = None         # the member being read, once named
+        self.key_start = None   # where a key, still to be read, began
+        self.start = None       # where the value being kept began
+        self.in_array = False   # inside the array member's brackets
+        self.done = False
+
+    def feed(self, data):
+        """Returns (kind, key, value) for each element ('item') and
+        member ('member') completed by data, in order."""
+        self.buf += data
+        out = []
+        buf = self.buf
+        pos = self.pos
+        while True:
+            if self.in_string:
+                m = _IN_STRING.search(buf, pos)
+                if m is None:
+                    pos = len(buf)
+                    break
+                pos = m.end()
+                if m.group() == '\\':
+                    if pos == len(buf):
+                        pos -= 1        # the escaped byte is not here yet
+                        break
+                    pos += 1
+                    continue
+                self.in_string = False
+                if self.key_start is not None:
+                    self.key = json.loads(buf[self.key_start:pos])
+                    self.key_start = None
+                continue
+            m = _SPECIAL.search(buf, pos)
+            if m is None:
+                pos = len(buf)
+                break
+            c = m.group()
+            pos = m.end()
+            if self.done:
+                raise ValueError('extra data after the object')
+            if c == '"':
+                self.in_string = True
+                if self.depth == 1 and self.key is None:
+                    self.key_start = pos - 1
+                continue
+            if c == ':':
+                if self.depth == 1 and self.key is not None:
+                    self.start = pos
+                continue
+            if c in '{[':
+                self.depth += 1
+                if self.depth == 2 and c == '[' and self.key == self.array:
+                    self.in_array = True
+                    self.start = pos
+                continue
+            end = pos - 1
+            if c in ']}':
+                self.depth -= 1
+                if self.depth < 0:
+                    raise ValueError('unbalanced %r' % c)
+            if self.in_array and (self.depth == 2 and c == ',' or
+                                  self.depth == 1 and c == ']'):
+                item = buf[self.start:end]
+                if item.strip():
+                    out.append(('item', self.key, json.loads(item)))
+                self.start = pos
+                if c == ']':
+                    self.in_array = False
+                    self.start = None
+            elif self.depth == 1 and c == ',' or self.depth == 0:
+                if self.start is not None:
+                    out.append(('member', self.key,
+                                json.loads(buf[self.start:end])))
+                self.key = self.start = None
+                self.done = (self.depth == 0)
+        # drop what is no longer wanted
+        keep = min(p for p in (self.start, self.key_start, pos)
+                   if p is not None)
+        self.buf = buf[keep:]
+        self.pos = pos - keep
+        if self.start is not None:
+            self.start -= keep
+        if self.key_start is not None:
+            self.key_start -= keep
+        return out
+
+    def close(self):
+        if not self.done:
+            raise ValueError('the JSON object is incomplete')
+
+class FormField(object):
+    """The value of field name in a form-urlencoded body."""
+
+    def __init__(self, name):
+        self.name = name
+        self.key = ''           # the field name being read, or None
+        self.wanted = False     # the value being read is name's
+        self.found = False
+        self.pending = ''       # an escape split between pieces
+
+    def feed(self, data):
+        out = []
+        while data:
+            if self.key is not None:
+                i = data.find('=')
+                j = data.find('&')
+                if j >= 0 and (i < 0 or j < i):
+                    self.key = ''           # a name without a value
+                    data = data[j + 1:]
+                    continue
+                if i < 0:
+                    self.key += data
+                    break
+                self.key += data[:i]
+                data = data[i + 1:]
+                self.wanted = (not self.found and
+                               urllib.unquote_plus(self.key) == self.name)
+                self.found = self.found or self.wanted
+                self.key = None
+            else:
+                j = data.find('&')
+                if j < 0:
+                    value, data = data, ''
+                else:
+                    value, data = data[:j], data[j + 1:]
+                if self.wanted:
+                    out.append(self._decode(value, j >= 0))
+                if j >= 0:
+                    self.key = ''
+                    self.wanted = False
+        return ''.join(out)
+
+    def _decode(self, value, last):
+        value = self.pending + value
+        self.pending = ''
+        if not last:
+            i = value.find('%', max(0, len(value) - 2))
+            if i >= 0:
+                value, self.pending = value[:i], value[i:]
+        return urllib.unquote_plus(value)
+
+    def close(self):
+        """The rest of the value, if the body ended inside it."""
+        value = urllib.unquote_plus(self.pending)
+        self.pending = ''
+        return value
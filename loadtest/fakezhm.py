@@ -0,0 +1,282 @@
+#!/usr/bin/python
+"""A local stand-in for the zephyr host manager.
+
+Speaks just enough of the ZEPH0.2 notice protocol to accept notices
+from zsend (or anything else linked against libzephyr), count them,
+and answer with HMACK, SERVACK or SERVNAK after a configurable delay.
+Point libzephyr at it by running it on the zephyr-hm port (2104) of a
+machine with no real zhm.
+
+zsend and zsendd send UNACKED notices, which only ever get an HMACK,
+so a zhm cannot refuse one; what the sender sees as a failure is the
+HMACK never coming.  So the NAK rate applies to those by withholding
+the HMACK, and to ACKED notices by answering SERVNAK.
+
+A notice too big for one packet arrives as several fragments, which
+share a multiuid; it is counted once, as the fragments add up to it.
+
+Can be run standalone, or imported and started in a thread by a load
+driver (see pushload.py) that wants arrival times for each notice.
+"""
+
+import optparse
+import random
+import socket
+import sys
+import threading
+import time
+
+# Notice kinds, from <zephyr/zephyr.h>
+UNSAFE, UNACKED, ACKED, HMACK, HMCTL, SERVACK, SERVNAK, CLIENTACK, STAT = range(9)
+
+KIND_NAMES = ['unsafe', 'unacked', 'acked', 'hmack', 'hmctl',
+              'servack', 'servnak', 'clientack', 'stat']
+
+# Header fields every ZEPH0.2 notice carries, in order (Z_NUMFIELDS)
+FIELDS = ['version', 'numfields', 'kind', 'uid', 'port', 'auth',
+          'authent_len', 'authent', 'class', 'instance', 'opcode',
+          'sender', 'recipient', 'format', 'checksum', 'multinotice',
+          'multiuid']
+
+DEFAULT_PORT = 2104
+
+class Notice(object):
+    def __init__(self, fields, other, message):
+        self.fields = fields
+        self.other = other
+        self.message = message
+
+    def __getitem__(self, name):
+        return self.fields[name]
+
+    @property
+    def kind(self):
+        return int(self.fields['kind'], 16)
+
+    @classmethod
+    def parse(cls, packet):
+        parts = packet.split('\0')
+        if len(parts) < len(FIELDS) or not parts[0].startswith('ZEPH'):
+            raise ValueError('not a zephyr notice')
+        numfields = int(parts[1], 16)
+        if numfields < len(FIELDS) or len(parts) < numfields:
+            raise ValueError('bad field count %d' % numfields)
+        fields = dict(zip(FIELDS, parts))
+        other = parts[len(FIELDS):numfields]
+        message = '\0'.join(parts[numfields:])
+        return cls(fields, other, message)
+
+    def format(self, kind=None, message=None):
+        fields = dict(self.fields)
+        if kind is not None:
+            fields['kind'] = '0x%08X' % kind
+        # Replies are never authenticated
+        fields['auth'] = '0x00000000'
+        fields['authent_len'] = '0x00000000'
+        fields['authent'] = ''
+        fields['checksum'] = '0x00000000'
+        header = [fields[f] for f in FIELDS] + self.other
+        if message is None:
+            message = self.message
+        return '\0'.join(header) + '\0' + message
+
+class Arrival(object):
+    def __init__(self, when, notice, addr):
+        self.when = when
+        self.notice = notice
+        self.addr = addr
+
+class FakeZhm(object):
+    """Accepts notices on a UDP port and acknowledges them.
+
+    ack_delay: seconds to wait before sending HMACK
+    serv_delay: seconds after that before SERVACK/SERVNAK (ACKED notices)
+    nak_rate: fraction of ACKED notices answered with SERVNAK, and of
+        UNACKED ones given no HMACK
+    drop_rate: fraction of notices not acknowledged at all
+    on_notice: called with an Arrival for every accepted notice
+    """
+
+    def __init__(self, host='127.0.0.1', port=DEFAULT_PORT, ack_delay=0.0,
+                 serv_delay=0.0, nak_rate=0.0, drop_rate=0.0,
+                 on_notice=None):
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 1 << 22)
+        self.sock.bind((host, port))
+        self.address = self.sock.getsockname()
+        self.ack_delay = ack_delay
+        self.serv_delay = serv_delay
+        self.nak_rate = nak_rate
+        self.drop_rate = drop_rate
+        self.on_notice = on_notice
+        self.lock = threading.Lock()
+        self.counts = dict((k, 0) for k in KIND_NAMES + ['bad', 'dropped',
+                                                         'naked',
+                                                         'fragments'])
+        # multiuid -> message bytes seen, of notices still arriving
+        self.partial = {}
+        self.first = None
+        self.last = None
+        self._running = False
+        self._thread = None
+
+    def _count(self, what):
+        self.lock.acquire()
+        try:
+            self.counts[what] += 1
+        finally:
+            self.lock.release()
+
+    def _count_notice(self, notice):
+        """Count a notice once, whichever of its fragments this is."""
+        try:
+            offset, total = [int(x) for x in
+                             notice['multinotice'].split('/')]
+        except ValueError:
+            offset, total = 0, len(notice.message)
+        self.lock.acquire()
+        try:
+            if offset == 0 and len(notice.message) >= total:
+                self.counts[KIND_NAMES[notice.kind]] += 1
+                return
+            self.counts['fragments'] += 1
+            key = notice['multiuid']
+            seen = self.partial.get(key)
+            if seen is None:
+                self.counts[KIND_NAMES[notice.kind]] += 1
+                seen = 0
+            seen += len(notice.message)
+            if seen >= total:
+                del self.partial[key]
+            else:
+                self.partial[key] = seen
+        finally:
+            self.lock.release()
+
+    def _reply(self, packet, addr, delay):
+        if delay > 0:
+            t = threading.Timer(delay, self.sock.sendto, (packet, addr))
+            t.daemon = True
+            t.start()
+        else:
+            self.sock.sendto(packet, addr)
+
+    def handle(self, packet, addr):
+        now = time.time()
+        try:
+            notice = Notice.parse(packet)
+            kind = notice.kind
+        except ValueError:
+            self._count('bad')
+            return
+        if kind in (UNSAFE, UNACKED, ACKED):
+            self._count_notice(notice)
+        elif 0 <= kind < len(KIND_NAMES):
+            self._count(KIND_NAMES[kind])
+        if kind == HMCTL:
+            # ZInitialize asks which server we are talking to
+            self._reply(notice.format(HMACK, 'localhost\0'), addr, 0)
+            return
+        if kind not in (UNSAFE, UNACKED, ACKED):
+            return
+        self.lock.acquire()
+        try:
+            if self.first is None:
+                self.first = now
+            self.last = now
+        finally:
+            self.lock.release()
+        if self.on_notice is not None:
+            self.on_notice(Arrival(now, notice, addr))
+        if kind == UNSAFE:
+            return
+        if self.drop_rate and random.random() < self.drop_rate:
+            self._count('dropped')
+            return
+        if (kind == UNACKED and self.nak_rate and
+            random.random() < self.nak_rate):
+            # the only failure an UNACKED notice can have
+            self._count('naked')
+            return
+        self._reply(notice.format(HMACK, ''), addr, self.ack_delay)
+        if kind == ACKED:
+            if self.nak_rate and random.random() < self.nak_rate:
+                self._count('naked')
+                reply = notice.format(SERVNAK, 'LOST\0')
+                self._reply(reply, addr, self.ack_delay + self.serv_delay)
+            else:
+                reply = notice.format(SERVACK, 'SENT\0')
+                self._reply(reply, addr, self.ack_delay + self.serv_delay)
+
+    def serve_forever(self):
+        self._running = True
+        self.sock.settimeout(0.2)
+        while self._running:
+            try:
+                packet, addr = self.sock.recvfrom(65536)
+            except socket.timeout:
+                continue
+            self.handle(packet, addr)
+
+    def start(self):
+        self._thread = threading.Thread(target=self.serve_forever)
+        self._thread.daemon = True
+        self._thread.start()
+        return self
+
+    def stop(self):
+        self._running = False
+        if self._thread is not None:
+            self._thread.join()
+        self.sock.close()
+
+    def accepted(self):
+        return (self.counts['unsafe'] + self.counts['unacked'] +
+                self.counts['acked'])
+
+    def rate(self):
+        if self.first is None or self.last == self.first:
+            return 0.0
+        return (self.accepted() - 1) / (self.last - self.first)
+
+    def summary(self):
+        counts = ' '.join('%s=%d' % (k, v) for k, v in sorted(self.counts.items())
+                          if v)
+        return 'accepted %d notices, %.1f notices/sec (%s)' % (
+            self.accepted(), self.rate(), counts)
+
+def main():
+    parser = optparse.OptionParser(usage='%prog [options]')
+    parser.add_option('--host', default='127.0.0.1')
+    parser.add_option('--port', type='int', default=DEFAULT_PORT)
+    parser.add_option('--ack-delay', type='float', default=0.0,
+                      help='seconds before HMACK')
+    parser.add_option('--serv-delay', type='float', default=0.0,
+                      help='seconds after HMACK before SERVACK/SERVNAK')
+    parser.add_option('--nak-rate', type='float', default=0.0,
+                      help='fraction of ACKED notices to SERVNAK, and of '
+                      'UNACKED ones not to HMACK')
+    parser.add_option('--drop-rate', type='float', default=0.0,
+                      help='fraction of notices never acknowledged')
+    parser.add_option('-v', '--verbose', action='store_true')
+    opts, args = parser.parse_args()
+
+    def show(arrival):
+        n = arrival.notice
+        print '%.6f %s class=%s instance=%s sender=%s recipient=%s len=%d' % (
+            arrival.when, KIND_NAMES[n.kind], n['class'], n['instance'],
+            n['sender'], n['recipient'], len(n.message))
+        sys.stdout.flush()
+
+    zhm = FakeZhm(opts.host, opts.port, opts.ack_delay, opts.serv_delay,
+                  opts.nak_rate, opts.drop_rate,
+                  opts.verbose and show or None)
+    print 'Listening on %s:%d' % zhm.address
+    try:
+        zhm.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    print zhm.summary()
+
+if __name__ == '__main__':
+    sys.exit(main())
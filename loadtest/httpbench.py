@@ -0,0 +1,147 @@
+#!/usr/bin/python
+"""Compare zcommit's HTTP front ends by requests/sec and latency.
+
+Each URL is driven in turn, closed-loop: -c clients each send a
+request, wait for the reply and send the next, for -d seconds.  The
+same push payload is POSTed every time, so the only difference between
+runs is the path a request takes to zcommit, e.g.
+
+    # fcgi: Apache, RewriteRule and FastCGI, as deployed
+    # http: zcommit.py --http 8080 --threads 16
+    loadtest/httpbench.py -c 16 -d 20 \\
+        fcgi=http://localhost/zcommit/github/class/loadtest \\
+        http=http://localhost:8080/zcommit/github/class/loadtest
+
+Clients keep their connections alive unless --close is given.  With
+--get, requests are GETs, which zcommit answers without sending any
+notices, to measure the front end alone.
+
+The fcgi run needs Apache with mod_fcgid (or mod_fastcgi) and flup,
+and both need CherryPy; none of these were to hand where this was
+written, so the comparison above has not been run.
+"""
+
+import httplib
+import json
+import optparse
+import os
+import sys
+import threading
+import time
+import urllib
+import urlparse
+
+HERE = os.path.abspath(os.path.dirname(__file__))
+sys.path.insert(0, HERE)
+
+from pushload import make_push, percentile
+
+class Bench(object):
+    def __init__(self, url, clients, duration, body, keepalive):
+        self.url = urlparse.urlsplit(url)
+        self.clients = clients
+        self.duration = duration
+        self.body = body
+        self.keepalive = keepalive
+        self.lock = threading.Lock()
+        self.latency = []
+        self.errors = 0
+        self.connects = 0
+
+    def _connect(self):
+        self.lock.acquire()
+        self.connects += 1
+        self.lock.release()
+        return httplib.HTTPConnection(self.url.hostname, self.url.port or 80,
+                                      timeout=30)
+
+    def worker(self, deadline):
+        path = self.url.path + (self.url.query and '?' + self.url.query)
+        headers = {}
+        if self.body is not None:
+            headers['Content-Type'] = 'application/x-www-form-urlencoded'
+        if not self.keepalive:
+            headers['Connection'] = 'close'
+        latency = []
+        errors = 0
+        conn = None
+        while time.time() < deadline:
+            if conn is None:
+                conn = self._connect()
+            start = time.time()
+            try:
+                conn.request(self.body is None and 'GET' or 'POST', path,
+                             self.body, headers)
+                resp = conn.getresponse()
+                resp.read()
+                if resp.status != 200:
+                    raise httplib.HTTPException('status %d' % resp.status)
+                if resp.will_close:
+                    conn.close()
+                    conn = None
+            except (httplib.HTTPException, IOError):
+                errors += 1
+                conn.close()
+                conn = None
+                continue
+            latency.append(time.time() - start)
+        if conn is not None:
+            conn.close()
+        self.lock.acquire()
+        self.latency.extend(latency)
+        self.errors += errors
+        self.lock.release()
+
+    def run(self):
+        start = time.time()
+        deadline = start + self.duration
+        workers = [threading.Thread(target=self.worker, args=(deadline,))
+                   for _ in xrange(self.clients)]
+        for w in workers:
+            w.daemon = True
+            w.start()
+        for w in workers:
+            w.join()
+        return time.time() - start
+
+def main():
+    parser = optparse.OptionParser(usage='%prog [options] [name=]url ...')
+    parser.add_option('-c', '--clients', type='int', default=8,
+                      help='concurrent connections')
+    parser.add_option('-d', '--duration', type='float', default=10.0,
+                      help='seconds to drive each URL')
+    parser.add_option('--commits', type='int', default=3,
+                      help='commits in the push payload')
+    parser.add_option('--files', type='int', default=4,
+                      help='files touched per commit')
+    parser.add_option('--get', action='store_true',
+                      help='send GETs, which send no notices')
+    parser.add_option('--close', action='store_true',
+                      help='a new connection for every request')
+    opts, args = parser.parse_args()
+    if not args:
+        parser.error('need at least one URL')
+
+    body = None
+    if not opts.get:
+        push = make_push(0, opts.commits, opts.files)
+        body = urllib.urlencode({'payload' : json.dumps(push)})
+
+    print '%-10s %9s %8s %8s %8s %8s %7s %6s' % (
+        'front end', 'req/sec', 'p50 ms', 'p90 ms', 'p99 ms', 'max ms',
+        'conns', 'errors')
+    for arg in args:
+        name, sep, url = arg.partition('=')
+        if not sep or '/' in name or ':' in name:
+            name, url = urlparse.urlsplit(arg).netloc, arg
+        bench = Bench(url, opts.clients, opts.duration, body, not opts.close)
+        elapsed = bench.run()
+        lat = bench.latency
+        print '%-10s %9.1f %8.2f %8.2f %8.2f %8.2f %7d %6d' % (
+            name, len(lat) / elapsed, 1000 * percentile(lat, 50),
+            1000 * percentile(lat, 90), 1000 * percentile(lat, 99),
+            1000 * (lat and max(lat) or float('nan')), bench.connects,
+            bench.errors)
+
+if __name__ == '__main__':
+    sys.exit(main())
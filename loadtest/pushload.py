@@ -0,0 +1,225 @@
+#!/usr/bin/python
+"""Replay synthetic GitHub push payloads into zcommit at a target rate.
+
+Each push is POSTed to the webhook URL the same way GitHub does it (a
+form-encoded 'payload' field holding JSON).  With --fake-zhm a FakeZhm
+is run in this process on the zephyr-hm port, so every notice zsend
+sends ends up here too; commits are matched to notices by the commit
+URL at the top of each message, giving end-to-end latency from the
+HTTP POST to the notice arriving.
+
+To drive zcommit without Apache, --serve mounts zcommit's Application
+on a local CherryPy HTTP server in this process.
+"""
+
+import json
+import optparse
+import os
+import random
+import re
+import sys
+import threading
+import time
+import urllib
+import urllib2
+
+HERE = os.path.abspath(os.path.dirname(__file__))
+sys.path.insert(0, os.path.dirname(HERE))
+
+import fakezhm
+
+COMMIT_RE = re.compile(r'/commit/([0-9a-f]{40})')
+
+WORDS = ('fix add remove refactor zephyr class instance notice sender '
+         'parser buffer realm ticket kerberos commit push branch').split()
+
+def make_push(seq, ncommits, nfiles):
+    """A push payload whose commit ids start with the push/commit number."""
+    commits = []
+    for i in xrange(ncommits):
+        cid = '%08x%04x%s' % (seq, i, ''.join(random.choice('0123456789abcdef')
+                                              for _ in xrange(28)))
+        files = ['src/%s/%s.c' % (random.choice(WORDS), random.choice(WORDS))
+                 for _ in xrange(nfiles)]
+        commits.append({
+            'id' : cid,
+            'url' : 'http://github.com/zcommit/loadtest/commit/%s' % cid,
+            'author' : {'name' : 'Load Test', 'email' : 'loadtest@mit.edu'},
+            'message' : ' '.join(random.choice(WORDS) for _ in xrange(12)),
+            'timestamp' : '2010-03-15T12:%02d:%02d-07:00' % (i // 60 % 60,
+                                                             i % 60),
+            'added' : files[:1],
+            'removed' : [],
+            'modified' : files[1:],
+        })
+    return {'ref' : 'refs/heads/master',
+            'before' : '0' * 40,
+            'after' : commits[-1]['id'],
+            'repository' : {'name' : 'loadtest',
+                            'url' : 'http://github.com/zcommit/loadtest'},
+            'commits' : commits}
+
+def percentile(values, p):
+    if not values:
+        return float('nan')
+    values = sorted(values)
+    k = min(len(values) - 1, int(round(p / 100.0 * (len(values) - 1))))
+    return values[k]
+
+class Driver(object):
+    def __init__(self, url, rate, total, threads, ncommits, nfiles):
+        self.url = url
+        self.rate = rate
+        self.total = total
+        self.threads = threads
+        self.ncommits = ncommits
+        self.nfiles = nfiles
+        self.lock = threading.Lock()
+        self.posted = {}          # commit id -> time the POST started
+        self.arrived = {}         # commit id -> time the notice arrived
+        self.http_latency = []
+        self.errors = 0
+        self.next_seq = 0
+        self.start_time = None
+
+    def on_notice(self, arrival):
+        m = COMMIT_RE.search(arrival.notice.message)
+        if m is None:
+            return
+        self.lock.acquire()
+        try:
+            self.arrived.setdefault(m.group(1), arrival.when)
+        finally:
+            self.lock.release()
+
+    def _claim(self):
+        self.lock.acquire()
+        try:
+            if self.next_seq >= self.total:
+                return None
+            seq = self.next_seq
+            self.next_seq += 1
+            return seq
+        finally:
+            self.lock.release()
+
+    def worker(self):
+        while True:
+            seq = self._claim()
+            if seq is None:
+                return
+            # open-loop pacing: push n goes out at start + n / rate
+            delay = self.start_time + float(seq) / self.rate - time.time()
+            if delay > 0:
+                time.sleep(delay)
+            push = make_push(seq, self.ncommits, self.nfiles)
+            body = urllib.urlencode({'payload' : json.dumps(push)})
+            start = time.time()
+            self.lock.acquire()
+            try:
+                for c in push['commits']:
+                    self.posted[c['id']] = start
+            finally:
+                self.lock.release()
+            try:
+                urllib2.urlopen(self.url, body).read()
+            except Exception, e:
+                self.lock.acquire()
+                self.errors += 1
+                self.lock.release()
+                print >>sys.stderr, 'push %d failed: %s' % (seq, e)
+                continue
+            self.lock.acquire()
+            self.http_latency.append(time.time() - start)
+            self.lock.release()
+
+    def run(self):
+        self.start_time = time.time()
+        workers = [threading.Thread(target=self.worker)
+                   for _ in xrange(self.threads)]
+        for w in workers:
+            w.daemon = True
+            w.start()
+        for w in workers:
+            w.join()
+        return time.time() - self.start_time
+
+    def report(self, elapsed, zhm, wait):
+        expected = self.total * self.ncommits
+        deadline = time.time() + wait
+        while zhm is not None and len(self.arrived) < expected \
+                and time.time() < deadline:
+            time.sleep(0.05)
+        print 'pushes: %d (%d commits each), %d errors, %.2fs, %.1f pushes/sec' % (
+            self.total, self.ncommits, self.errors, elapsed,
+            self.total / elapsed)
+        print 'http: p50 %.1fms p99 %.1fms' % (
+            1000 * percentile(self.http_latency, 50),
+            1000 * percentile(self.http_latency, 99))
+        if zhm is None:
+            return
+        latency = [self.arrived[c] - self.posted[c]
+                   for c in self.arrived if c in self.posted]
+        print 'notices: %d of %d arrived' % (len(latency), expected)
+        print 'end-to-end: p50 %.1fms p99 %.1fms max %.1fms' % (
+            1000 * percentile(latency, 50), 1000 * percentile(latency, 99),
+            1000 * (latency and max(latency) or float('nan')))
+        print 'fake zhm: %s' % zhm.summary()
+
+def serve(port):
+    import cherrypy
+    import zcommit
+    cherrypy.config.update({'server.socket_host' : '127.0.0.1',
+                            'server.socket_port' : port,
+                            'log.screen' : False})
+    cherrypy.tree.mount(zcommit.Application(), '/zcommit')
+    cherrypy.engine.start()
+    return 'http://127.0.0.1:%d/zcommit/github/class/loadtest' % port
+
+def main():
+    parser = optparse.OptionParser(usage='%prog [options] [url]')
+    parser.add_option('-r', '--rate', type='float', default=10.0,
+                      help='pushes per second to attempt')
+    parser.add_option('-n', '--pushes', type='int', default=100)
+    parser.add_option('-c', '--commits', type='int', default=3,
+                      help='commits per push')
+    parser.add_option('-f', '--files', type='int', default=4,
+                      help='files touched per commit')
+    parser.add_option('-t', '--threads', type='int', default=8,
+                      help='concurrent HTTP clients')
+    parser.add_option('--serve', type='int', metavar='PORT',
+                      help='run zcommit in-process on PORT and drive it')
+    parser.add_option('--fake-zhm', action='store_true',
+                      help='run a fake zephyr host manager and measure '
+                      'end-to-end latency')
+    parser.add_option('--zhm-port', type='int', default=fakezhm.DEFAULT_PORT)
+    parser.add_option('--ack-delay', type='float', default=0.0)
+    parser.add_option('--nak-rate', type='float', default=0.0)
+    parser.add_option('--wait', type='float', default=10.0,
+                      help='seconds to wait for stragglers after the last push')
+    opts, args = parser.parse_args()
+
+    if opts.serve:
+        url = serve(opts.serve)
+    elif len(args) == 1:
+        url = args[0]
+    else:
+        parser.error('need a webhook URL or --serve')
+
+    driver = Driver(url, opts.rate, opts.pushes, opts.threads,
+                    opts.commits, opts.files)
+    zhm = None
+    if opts.fake_zhm:
+        zhm = fakezhm.FakeZhm(port=opts.zhm_port, ack_delay=opts.ack_delay,
+                              nak_rate=opts.nak_rate,
+                              on_notice=driver.on_notice).start()
+    elapsed = driver.run()
+    driver.report(elapsed, zhm, opts.wait)
+    if zhm is not None:
+        zhm.stop()
+    if opts.serve:
+        import cherrypy
+        cherrypy.engine.exit()
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,142 @@
+#!/usr/bin/python
+"""Send a batch of notices through a zsendd of its own, as fast as it
+will take them.
+
+A zsendd (by default bin/zsendd) is started on a socket in a scratch
+directory, -t clients each submit their share of -n notices over it,
+and zsendd is stopped with SIGTERM, so that it exits normally.  With
+--fake-zhm a FakeZhm on the zephyr-hm port acknowledges the notices,
+so this needs no zephyr servers.  Besides measuring zsendd, this is the
+batch-send workload that 'make pgo' trains zsendd on.
+"""
+
+import optparse
+import os
+import shutil
+import signal
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+HERE = os.path.abspath(os.path.dirname(__file__))
+sys.path.insert(0, os.path.dirname(HERE))
+
+import fakezhm
+import zsendlib
+from pushload import WORDS, percentile
+
+class Sender(object):
+    def __init__(self, path, total, clients, size, binary):
+        self.client = zsendlib.Client(path, binary)
+        self.total = total
+        self.clients = clients
+        text = ' '.join(WORDS)
+        self.message = (text * (size // len(text) + 1))[:size]
+        self.lock = threading.Lock()
+        self.sent = 0
+        self.errors = 0
+        self.latency = []
+
+    def _claim(self):
+        self.lock.acquire()
+        try:
+            if self.sent >= self.total:
+                return None
+            self.sent += 1
+            return self.sent
+        finally:
+            self.lock.release()
+
+    def worker(self):
+        latency = []
+        errors = 0
+        while True:
+            seq = self._claim()
+            if seq is None:
+                break
+            start = time.time()
+            try:
+                self.client.send('loadtest', 'batch %d' % (seq % 16),
+                                 self.message, sender='loadtest',
+                                 signature='sendload %d' % seq)
+            except (zsendlib.ZsendError, EnvironmentError):
+                errors += 1
+                continue
+            latency.append(time.time() - start)
+        self.lock.acquire()
+        self.latency.extend(latency)
+        self.errors += errors
+        self.lock.release()
+
+    def run(self):
+        start = time.time()
+        workers = [threading.Thread(target=self.worker)
+                   for _ in xrange(self.clients)]
+        for w in workers:
+            w.daemon = True
+            w.start()
+        for w in workers:
+            w.join()
+        return time.time() - start
+
+def start_zsendd(zsendd, path, args, timeout=5.0):
+    proc = subprocess.Popen([zsendd, '-l', path] + args)
+    deadline = time.time() + timeout
+    while not os.path.exists(path):
+        if proc.poll() is not None or time.time() > deadline:
+            raise RuntimeError('%s did not start' % zsendd)
+        time.sleep(0.02)
+    return proc
+
+def main():
+    parser = optparse.OptionParser(usage='%prog [options] [-- zsendd options]')
+    parser.add_option('--zsendd', default=os.path.join(os.path.dirname(HERE),
+                                                       'bin', 'zsendd'))
+    parser.add_option('-n', '--notices', type='int', default=2000)
+    parser.add_option('-t', '--threads', type='int', default=4,
+                      help='concurrent clients')
+    parser.add_option('-s', '--size', type='int', default=200,
+                      help='message bytes')
+    parser.add_option('--binary', action='store_true',
+                      help="submit in lread's binary encoding")
+    parser.add_option('--fake-zhm', action='store_true',
+                      help='run a fake zephyr host manager')
+    parser.add_option('--zhm-port', type='int', default=fakezhm.DEFAULT_PORT)
+    opts, args = parser.parse_args()
+
+    zhm = None
+    if opts.fake_zhm:
+        zhm = fakezhm.FakeZhm(port=opts.zhm_port).start()
+    scratch = tempfile.mkdtemp(prefix='sendload')
+    path = os.path.join(scratch, 'zsendd.sock')
+    try:
+        proc = start_zsendd(opts.zsendd, path, args)
+        try:
+            sender = Sender(path, opts.notices, opts.threads, opts.size,
+                            opts.binary)
+            elapsed = sender.run()
+        finally:
+            os.kill(proc.pid, signal.SIGTERM)
+            status = proc.wait()
+    finally:
+        shutil.rmtree(scratch)
+        if zhm is not None:
+            zhm.stop()
+
+    lat = sender.latency
+    print 'notices: %d, %d errors, %.2fs, %.1f notices/sec' % (
+        opts.notices, sender.errors, elapsed, len(lat) / elapsed)
+    print 'submit: p50 %.2fms p99 %.2fms max %.2fms' % (
+        1000 * percentile(lat, 50), 1000 * percentile(lat, 99),
+        1000 * (lat and max(lat) or float('nan')))
+    if zhm is not None:
+        print 'fake zhm: %s' % zhm.summary()
+    if status != 0:
+        print >>sys.stderr, 'zsendd exited with status %d' % status
+        return 1
+    return sender.errors and 1 or 0
+
+if __name__ == '__main__':
+    sys.exit(main())
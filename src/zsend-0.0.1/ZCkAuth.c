@@ -1,6 +1,9 @@
 /* Modifications for tzc by Darrell Kindred <dkindred@cmu.edu>, April 1997:
  *   - cache the kerberos credentials, so we can continue to check auth
  *     even if the user re-kinits.
+ * Since then:
+ *   - refresh them before they expire, and remember for a while that
+ *     there are none.
  */
 
 /* This file is part of the Project Athena Zephyr Notification System.
@@ -25,6 +28,48 @@
 #define ZAUTH_UNSET (-3)      /* from internal.h */
 #include <stdio.h>	      /* for NULL */
 #endif
+#include <string.h>
+#include <time.h>
+
+#ifdef ZEPHYR_USES_KERBEROS
+/* Only our own realm's ticket is ever used: every notice reaches us
+ * through our own servers, which make its checksum with the session
+ * key of our ticket for them, even when it came from another realm.
+ * So one ticket is cached.  It is used until it is within REFRESH_SECS
+ * of expiring, when the ticket file is read again; if that fails (the
+ * user has kdestroyed, say) the old ticket is kept until it really
+ * expires.  If there is no ticket, the file is not read again for
+ * NEGATIVE_SECS. */
+#define REFRESH_SECS	(5 * 60)
+#define NEGATIVE_SECS	60
+
+static int have_cred = 0;
+static CREDENTIALS cached_cred;
+static time_t cred_expires;	/* of cached_cred, if have_cred */
+static time_t cred_retry;	/* don't call krb_get_cred before this */
+
+/* Usable credentials for our own realm, or NULL. */
+static CREDENTIALS *get_cred()
+{
+    time_t now = time(NULL);
+
+    if (have_cred && now >= cred_expires)
+	have_cred = 0;
+    if ((!have_cred || now >= cred_expires - REFRESH_SECS) &&
+	now >= cred_retry) {
+	CREDENTIALS fresh;
+
+	if (krb_get_cred(SERVER_SERVICE, SERVER_INSTANCE, __Zephyr_realm,
+			 &fresh) == 0) {
+	    cached_cred = fresh;
+	    cred_expires = krb_life_to_time(fresh.issue_date, fresh.lifetime);
+	    have_cred = 1;
+	} else
+	    cred_retry = now + NEGATIVE_SECS;
+    }
+    return have_cred ? &cached_cred : NULL;
+}
+#endif /* ZEPHYR_USES_KERBEROS */
 
 /* Check authentication of the notice.
    If it looks authentic but fails the Kerberos check, return -1.
@@ -39,10 +84,8 @@ Code_t ZCheckAuthentication(notice, from)
     struct sockaddr_in *from;
 {	
 #ifdef ZEPHYR_USES_KERBEROS
-    int result;
     ZChecksum_t our_checksum;
-    static CREDENTIALS cred;
-    static int got_cred = 0;
+    CREDENTIALS *cred;
 
     /* If the value is already known, return it. */
     if (notice->z_checked_auth != ZAUTH_UNSET)
@@ -51,20 +94,16 @@ Code_t ZCheckAuthentication(notice, from)
     if (!notice->z_auth)
 	return (ZAUTH_NO);
 	
-    if (!got_cred &&
-	(result = krb_get_cred(SERVER_SERVICE, SERVER_INSTANCE, 
-			       __Zephyr_realm, &cred)) != 0)
+    if ((cred = get_cred()) == NULL)
       return (ZAUTH_NO);
 
-    got_cred = 1;
-
 #ifdef NOENCRYPTION
     our_checksum = 0;
 #else /* NOENCRYPTION */
     our_checksum = des_quad_cksum(notice->z_packet, NULL, 
                                 notice->z_default_format+
                                 strlen(notice->z_default_format)+1-
-                                notice->z_packet, 0, cred.session);
+                                notice->z_packet, 0, cred->session);
 #endif /* NOENCRYPTION */
     /* if mismatched checksum, then the packet was corrupted */
     return ((our_checksum == notice->z_checksum) ? ZAUTH_YES : ZAUTH_FAILED);
@@ -72,4 +111,5 @@ Code_t ZCheckAuthentication(notice, from)
 #else /* ZEPHYR_USES_KERBEROS */
     return (notice->z_auth ? ZAUTH_YES : ZAUTH_NO);
 #endif
-} 
+}
+
@@ -0,0 +1,153 @@
+/* Modifications for zsend:
+ *   - cache the kerberos credentials and the authenticator made from
+ *     them, so that an authenticated notice costs a checksum and not
+ *     a read of the ticket file; both are refreshed before they expire.
+ */
+
+/* This file is part of the Project Athena Zephyr Notification System.
+ * It contains source for the ZMakeAuthentication function.
+ *
+ *	Created by:	Robert French
+ *
+ *	/mit/zephyr/src/CVS/zephyr/lib/zephyr/ZMkAuth.c,v
+ *	ghudson
+ *
+ *	Copyright (c) 1987 by the Massachusetts Institute of Technology.
+ *	For copying and distribution information, see the file
+ *	"mit-copyright.h".
+ */
+
+
+#if 0
+#include <internal.h>
+#else
+#include <zephyr/zephyr.h>
+#include <stdio.h>	      /* for NULL */
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+extern Code_t Z_FormatRawHeader();
+
+#ifdef ZEPHYR_USES_KERBEROS
+extern Code_t ZMakeAscii(), ZMakeAscii32();
+extern unsigned long des_quad_cksum();
+extern int krb_err_base;
+
+/* The server accepts an authenticator for a while; libzephyr reuses
+ * one for two minutes, and so do we.  Credentials are fetched again
+ * when they are this close to expiring. */
+#define AUTHENT_SECS	120
+#define REFRESH_SECS	(5 * 60)
+
+static CREDENTIALS cred;
+static time_t cred_expires = 0;		/* 0 if we have none */
+static char *ascii_authent = NULL;	/* made from cred */
+static int authent_len;
+static time_t authent_time = 0;
+
+/* Make sure cred and ascii_authent are current. */
+static Code_t refresh()
+{
+    KTEXT_ST authent;
+    CREDENTIALS fresh;
+    time_t now = time(NULL);
+    int result;
+
+    if (cred_expires == 0 || now >= cred_expires - REFRESH_SECS) {
+	if ((result = krb_get_cred(SERVER_SERVICE, SERVER_INSTANCE,
+				   __Zephyr_realm, &fresh)) != KSUCCESS) {
+	    /* keep using what we have until it really expires */
+	    if (cred_expires == 0 || now >= cred_expires)
+		return (result+krb_err_base);
+	} else {
+	    cred = fresh;
+	    cred_expires = krb_life_to_time(fresh.issue_date, fresh.lifetime);
+	    authent_time = 0;
+	}
+    }
+
+    if (authent_time == 0 || now - authent_time > AUTHENT_SECS) {
+	result = krb_mk_req(&authent, SERVER_SERVICE, SERVER_INSTANCE,
+			    __Zephyr_realm, 0);
+	if (result != MK_AP_OK) {
+	    authent_time = 0;
+	    return (result+krb_err_base);
+	}
+	free(ascii_authent);
+	if ((ascii_authent = (char *) malloc((unsigned) authent.length*3))
+	    == NULL) {
+	    authent_time = 0;
+	    return (ENOMEM);
+	}
+	if ((result = ZMakeAscii(ascii_authent, authent.length*3,
+				 authent.dat, authent.length)) != ZERR_NONE) {
+	    free(ascii_authent);
+	    ascii_authent = NULL;
+	    authent_time = 0;
+	    return (result);
+	}
+	authent_len = authent.length;
+	authent_time = now;
+    }
+    return (ZERR_NONE);
+}
+#endif /* ZEPHYR_USES_KERBEROS */
+
+/* Forget the cached authenticator and credentials, e.g. after the
+   user has got new tickets. */
+Code_t ZResetAuthentication()
+{
+#ifdef ZEPHYR_USES_KERBEROS
+    cred_expires = 0;
+    authent_time = 0;
+#endif
+    return ZERR_NONE;
+}
+
+Code_t ZMakeAuthentication(notice, buffer, buffer_len, len)
+    register ZNotice_t *notice;
+    char *buffer;
+    int buffer_len;
+    int *len;
+{
+#ifdef ZEPHYR_USES_KERBEROS
+    int result;
+    char *cstart, *cend;
+    ZChecksum_t checksum;
+
+    if ((result = refresh()) != ZERR_NONE)
+	return (result);
+
+    notice->z_auth = 1;
+    notice->z_authent_len = authent_len;
+    notice->z_ascii_authent = ascii_authent;
+    result = Z_FormatRawHeader(notice, buffer, buffer_len, len,
+			       &cstart, &cend);
+    notice->z_ascii_authent = NULL;
+    notice->z_authent_len = 0;
+    if (result != ZERR_NONE)
+	return (result);
+
+    /* Compute a checksum over the header, less the checksum field
+       itself, and the message, which is not in buffer yet. */
+    checksum = des_quad_cksum(buffer, NULL, cstart - buffer, 0,
+			      cred.session);
+    checksum ^= des_quad_cksum(cend, NULL, buffer + *len - cend, 0,
+			       cred.session);
+    checksum ^= des_quad_cksum(notice->z_message, NULL,
+			       notice->z_message_len, 0, cred.session);
+    notice->z_checksum = checksum;
+    ZMakeAscii32(cstart, buffer + buffer_len - cstart, checksum);
+
+    return (ZERR_NONE);
+#else
+    notice->z_checksum = 0;
+    notice->z_auth = 1;
+    notice->z_authent_len = 0;
+    notice->z_ascii_authent = "";
+    return (Z_FormatRawHeader(notice, buffer, buffer_len, len, NULL, NULL));
+#endif
+}
@@ -0,0 +1,286 @@
+/*
+   evloop.c  single-threaded epoll event loop
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+
+#include "evloop.h"
+
+#define MAX_EVENTS	256
+
+typedef struct {
+   EvCallback	cb;
+   void		*arg;
+} Handler;
+
+struct EvTimer {
+   EvLoop	*loop;
+   int		fd;
+   long long	deadline;	/* ms, 0 if not armed */
+   EvTimerCallback cb;
+   void		*arg;
+};
+
+struct EvLoop {
+   int		epfd;
+   int		stopping;
+
+   Handler	*handlers;	/* indexed by fd */
+   int		nhandlers;
+
+   int		sigfd;		/* -1 until ev_signal() */
+   sigset_t	sigmask;
+   EvSignalCallback sigcb[NSIG];
+   void		*sigarg[NSIG];
+};
+
+/* Monotonic milliseconds; 64 bits, as a 32-bit long wraps in 24 days. */
+long long
+ev_now_ms(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000L;
+}
+
+EvLoop *
+ev_new(void)
+{
+   EvLoop *loop = (EvLoop *) calloc(1, sizeof(EvLoop));
+
+   if (loop == NULL)
+      return NULL;
+   if ((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+      free(loop);
+      return NULL;
+   }
+   loop->sigfd = -1;
+   sigemptyset(&loop->sigmask);
+   return loop;
+}
+
+void
+ev_free(EvLoop *loop)
+{
+   if (loop->sigfd >= 0)
+      close(loop->sigfd);
+   close(loop->epfd);
+   free(loop->handlers);
+   free(loop);
+}
+
+static int
+set_handler(EvLoop *loop, int fd, EvCallback cb, void *arg)
+{
+   if (fd >= loop->nhandlers) {
+      int n = loop->nhandlers ? loop->nhandlers : 64;
+      Handler *h;
+      while (n <= fd)
+	 n *= 2;
+      if ((h = (Handler *) realloc(loop->handlers, n * sizeof(Handler))) == NULL)
+	 return -1;
+      memset(h + loop->nhandlers, 0, (n - loop->nhandlers) * sizeof(Handler));
+      loop->handlers = h;
+      loop->nhandlers = n;
+   }
+   loop->handlers[fd].cb = cb;
+   loop->handlers[fd].arg = arg;
+   return 0;
+}
+
+/* Watch fd for events, calling cb when any of them happen. */
+int
+ev_add(EvLoop *loop, int fd, unsigned events, EvCallback cb, void *arg)
+{
+   struct epoll_event ev;
+
+   if (set_handler(loop, fd, cb, arg) < 0)
+      return -1;
+   memset(&ev, 0, sizeof(ev));
+   ev.events = events;
+   ev.data.fd = fd;
+   return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int
+ev_modify(EvLoop *loop, int fd, unsigned events)
+{
+   struct epoll_event ev;
+
+   memset(&ev, 0, sizeof(ev));
+   ev.events = events;
+   ev.data.fd = fd;
+   return epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+/* Stop watching fd.  Call this before closing it. */
+int
+ev_remove(EvLoop *loop, int fd)
+{
+   if (fd < loop->nhandlers)
+      loop->handlers[fd].cb = NULL;
+   return epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static void
+timer_ready(EvLoop *loop, int fd, unsigned events, void *arg)
+{
+   EvTimer *t = (EvTimer *) arg;
+   unsigned long long expirations;
+
+   if (read(fd, &expirations, sizeof(expirations)) < 0)
+      return;
+   t->deadline = 0;
+   t->cb(loop, t, t->arg);
+}
+
+/* A one-shot timer, initially disarmed. */
+EvTimer *
+ev_timer(EvLoop *loop, EvTimerCallback cb, void *arg)
+{
+   EvTimer *t = (EvTimer *) calloc(1, sizeof(EvTimer));
+
+   if (t == NULL)
+      return NULL;
+   t->loop = loop;
+   t->cb = cb;
+   t->arg = arg;
+   if ((t->fd = timerfd_create(CLOCK_MONOTONIC,
+			       TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+      free(t);
+      return NULL;
+   }
+   if (ev_add(loop, t->fd, EPOLLIN, timer_ready, t) < 0) {
+      close(t->fd);
+      free(t);
+      return NULL;
+   }
+   return t;
+}
+
+/* Fire in ms milliseconds (0 for as soon as possible), replacing any
+ * earlier setting; a negative ms disarms the timer. */
+int
+ev_timer_set(EvTimer *t, long ms)
+{
+   struct itimerspec its;
+
+   memset(&its, 0, sizeof(its));
+   if (ms >= 0) {
+      /* an all-zero it_value would disarm instead */
+      its.it_value.tv_sec = ms / 1000;
+      its.it_value.tv_nsec = (ms % 1000) * 1000000L + (ms == 0);
+      t->deadline = ev_now_ms() + ms;
+   }
+   else
+      t->deadline = 0;
+   return timerfd_settime(t->fd, 0, &its, NULL);
+}
+
+/* Milliseconds until t fires, or -1 if it is not armed. */
+long
+ev_timer_pending(EvTimer *t)
+{
+   long long left;
+
+   if (t->deadline == 0)
+      return -1;
+   left = t->deadline - ev_now_ms();
+   return left > 0 ? (long) left : 0;
+}
+
+void
+ev_timer_free(EvTimer *t)
+{
+   ev_remove(t->loop, t->fd);
+   close(t->fd);
+   free(t);
+}
+
+static void
+signal_ready(EvLoop *loop, int fd, unsigned events, void *arg)
+{
+   struct signalfd_siginfo si;
+
+   while (read(fd, &si, sizeof(si)) == sizeof(si))
+      if (si.ssi_signo < NSIG && loop->sigcb[si.ssi_signo] != NULL)
+	 loop->sigcb[si.ssi_signo](loop, si.ssi_signo,
+				   loop->sigarg[si.ssi_signo]);
+}
+
+/* Deliver signo through the loop instead of as an asynchronous signal. */
+int
+ev_signal(EvLoop *loop, int signo, EvSignalCallback cb, void *arg)
+{
+   int fd;
+
+   sigaddset(&loop->sigmask, signo);
+   if (sigprocmask(SIG_BLOCK, &loop->sigmask, NULL) < 0)
+      return -1;
+   loop->sigcb[signo] = cb;
+   loop->sigarg[signo] = arg;
+   if ((fd = signalfd(loop->sigfd, &loop->sigmask,
+		      SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+      return -1;
+   if (loop->sigfd < 0) {
+      loop->sigfd = fd;
+      return ev_add(loop, fd, EPOLLIN, signal_ready, NULL);
+   }
+   return 0;
+}
+
+/* Dispatch events until ev_stop() is called.  Returns 0, or -1 with
+ * errno set if epoll_wait() fails. */
+int
+ev_run(EvLoop *loop)
+{
+   struct epoll_event events[MAX_EVENTS];
+   int i, n, fd;
+
+   loop->stopping = 0;
+   while (!loop->stopping) {
+      if ((n = epoll_wait(loop->epfd, events, MAX_EVENTS, -1)) < 0) {
+	 if (errno == EINTR)
+	    continue;
+	 return -1;
+      }
+      for (i = 0; i < n; i++) {
+	 fd = events[i].data.fd;
+	 /* an earlier callback in this batch may have removed fd */
+	 if (fd < loop->nhandlers && loop->handlers[fd].cb != NULL)
+	    loop->handlers[fd].cb(loop, fd, events[i].events,
+				  loop->handlers[fd].arg);
+      }
+   }
+   return 0;
+}
+
+void
+ev_stop(EvLoop *loop)
+{
+   loop->stopping = 1;
+}
@@ -0,0 +1,57 @@
+/*
+   evloop.h  single-threaded epoll event loop
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+   Every source of events is a file descriptor: sockets are watched
+   directly, timers are timerfds and signals arrive through a signalfd,
+   so one epoll_wait() covers them all and nothing ever busy-polls.
+   Callbacks run on the loop's thread and must not block.
+  */
+
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+#include <sys/epoll.h>
+
+typedef struct EvLoop EvLoop;
+typedef struct EvTimer EvTimer;
+
+/* events is the epoll event mask (EPOLLIN, EPOLLOUT, EPOLLHUP...) */
+typedef void (*EvCallback)(EvLoop *loop, int fd, unsigned events, void *arg);
+typedef void (*EvTimerCallback)(EvLoop *loop, EvTimer *t, void *arg);
+typedef void (*EvSignalCallback)(EvLoop *loop, int signo, void *arg);
+
+extern EvLoop *ev_new(void);
+extern void ev_free(EvLoop *loop);
+
+extern int ev_add(EvLoop *loop, int fd, unsigned events,
+		  EvCallback cb, void *arg);
+extern int ev_modify(EvLoop *loop, int fd, unsigned events);
+extern int ev_remove(EvLoop *loop, int fd);
+
+extern EvTimer *ev_timer(EvLoop *loop, EvTimerCallback cb, void *arg);
+extern int ev_timer_set(EvTimer *t, long ms);
+extern long ev_timer_pending(EvTimer *t);
+extern void ev_timer_free(EvTimer *t);
+
+extern int ev_signal(EvLoop *loop, int signo, EvSignalCallback cb, void *arg);
+
+extern int ev_run(EvLoop *loop);
+extern void ev_stop(EvLoop *loop);
+
+extern long long ev_now_ms(void);
+
+#endif /* EVLOOP_H */
@@ -0,0 +1,326 @@
+/*
+   lbulk.c  parse a stream of s-expressions on several threads
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+   The stream is cut into one region per thread, each starting just
+   after a newline, and then:
+
+   1. Each thread scans its region for quotes, backslashes and parens,
+      a word at a time where there are none, counting the parens inside
+      strings and outside them separately: until it knows whether the
+      region starts inside a string it cannot tell which is which.
+      A region starts after a newline, so never just after a backslash,
+      and the quotes that count are the same either way.
+   2. Going through the regions in order from the start of the stream,
+      which is outside everything, those counts say whether each region
+      starts in a string, and how many lists deep.
+   3. Each thread steps over the end of whatever its region starts in
+      the middle of, and vparse()s one value after another from there,
+      until the next would start in the following region.
+
+   Where a region's values do not begin where the ones before it left
+   off, which only malformed input can bring about, the rest of the
+   stream is parsed in the calling thread, so the result is always what
+   vparse() alone would give.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "lread.h"
+#include "lbulk.h"
+
+/* Less than this per thread is not worth a thread. */
+#define MIN_REGION	(256 * 1024)
+
+/* Word-at-a-time test for a byte: nonzero if any byte of w is c. */
+#define ONES		(~0UL / 255)
+#define HIGHS		(ONES * 0x80)
+#define HAS_BYTE(w, c)	((((w) ^ ONES * (c)) - ONES) & ~((w) ^ ONES * (c)) & HIGHS)
+
+/* what read_value() steps over between values */
+#define IS_SPACE(c)	((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\0')
+
+typedef struct Region Region;
+struct Region {
+   char		*start, *end;
+   char		*stream, *stream_end;
+   int		flags;
+
+   /* step 1 */
+   int		quotes;		/* odd or even number */
+   long		parens[2];	/* net opened, with quotes so far even, odd */
+
+   /* step 2 */
+   int		in_string;
+   long		depth;
+
+   /* step 3 */
+   char		*first;		/* the first value starting in the region */
+   char		*next;		/* the first one after it */
+   char		*last_end;	/* the end of the last one, or NULL */
+   int		failed;		/* vparse() gave up at next */
+   Value	**values;
+   long		nvalues;
+   long		maxvalues;
+};
+
+static void *
+scan_region(void *arg)
+{
+   Region *r = (Region *) arg;
+   char *p = r->start, *end = r->end;
+   unsigned long w;
+   int q = 0;
+
+   while (p < end) {
+      if (end - p >= (long) sizeof(w)) {
+	 memcpy(&w, p, sizeof(w));
+	 if (!(HAS_BYTE(w, '"') | HAS_BYTE(w, '\\') |
+	       HAS_BYTE(w, '(') | HAS_BYTE(w, ')'))) {
+	    p += sizeof(w);
+	    continue;
+	 }
+      }
+      switch (*p++) {
+       case '\\':
+	 p++;
+	 break;
+       case '"':
+	 q ^= 1;
+	 break;
+       case '(':
+	 r->parens[q]++;
+	 break;
+       case ')':
+	 r->parens[q]--;
+	 break;
+      }
+   }
+   r->quotes = q;
+   return NULL;
+}
+
+/* Where the first value at or after the start of the region begins:
+ * past the end of whatever the region starts in, and any space. */
+static char *
+first_value(Region *r)
+{
+   char *p = r->start, *end = r->stream_end;
+   int in_string = r->in_string;
+   long depth = r->depth;
+
+   while (p < end && (in_string || depth > 0)) {
+      switch (*p++) {
+       case '\\':
+	 p++;
+	 break;
+       case '"':
+	 in_string = !in_string;
+	 break;
+       case '(':
+	 depth += !in_string;
+	 break;
+       case ')':
+	 depth -= !in_string;
+	 break;
+      }
+   }
+   while (p < end && IS_SPACE(*p))
+      p++;
+   return p < end ? p : end;
+}
+
+static void
+add_value(Region *r, Value *v)
+{
+   if (r->nvalues == r->maxvalues) {
+      r->maxvalues = r->maxvalues ? 2 * r->maxvalues : 1024;
+      r->values = (Value **) realloc(r->values,
+				     r->maxvalues * sizeof(Value *));
+   }
+   r->values[r->nvalues++] = v;
+}
+
+/* vparse() values from p, for as long as they start before stop. */
+static void
+parse_from(Region *r, char *p, char *stop)
+{
+   long left;
+   Value *v;
+   int n;
+
+   while (p < stop) {
+      /* vparse() called on the space before a ')' or '.' reads nil,
+       * and called on the ')' or '.' itself, nothing */
+      if ((*p == ')' || *p == '.') && p > r->stream && IS_SPACE(p[-1])) {
+	 add_value(r, NULL);
+	 r->last_end = p;
+	 r->failed = 1;
+	 break;
+      }
+      left = r->stream_end - p;
+      if ((n = vparse(left > INT_MAX ? INT_MAX : (int) left, p, &v,
+		      r->flags)) <= 0) {
+	 r->failed = 1;
+	 break;
+      }
+      add_value(r, v);
+      p += n;
+      r->last_end = p;
+      while (p < r->stream_end && IS_SPACE(*p))
+	 p++;
+   }
+   r->next = p;
+}
+
+static void *
+parse_region(void *arg)
+{
+   Region *r = (Region *) arg;
+
+   r->first = first_value(r);
+   parse_from(r, r->first, r->end);
+   return NULL;
+}
+
+/* Run fn on every region, each on its own thread but the first, which
+ * gets the calling thread. */
+static void
+run_regions(Region *regions, int n, void *(*fn)(void *))
+{
+   pthread_t *threads = (pthread_t *) malloc(n * sizeof(pthread_t));
+   int *started = (int *) calloc(n, sizeof(int));
+   int i;
+
+   for (i = 1; i < n; i++)
+      started[i] = (pthread_create(&threads[i], NULL, fn, &regions[i]) == 0);
+   fn(&regions[0]);
+   for (i = 1; i < n; i++)
+      if (started[i])
+	 pthread_join(threads[i], NULL);
+      else
+	 fn(&regions[i]);
+   free(threads);
+   free(started);
+}
+
+/* Parse the values in the len bytes at s, with vparse() flags, on up
+ * to nthreads threads.  *values is set to a malloc'd array of them, in
+ * order, and *consumed to the bytes up to the end of the last one;
+ * whatever follows is an incomplete or invalid value, or space.
+ * Returns the number of values. */
+long
+vparse_bulk(long len, char *s, int flags, int nthreads, Value ***values,
+	    long *consumed)
+{
+   Region *regions, *r, tail;
+   char *cut, *nl, *expect, *last_end = NULL;
+   long nvalues = 0, i;
+   int nregions, in_string, k, n, stopped = 0;
+   long depth;
+
+   if (nthreads < 1)
+      nthreads = 1;
+   if (nthreads > len / MIN_REGION)
+      nthreads = len / MIN_REGION > 0 ? (int) (len / MIN_REGION) : 1;
+   regions = (Region *) calloc(nthreads, sizeof(Region));
+
+   /* cut just after a newline, and never into an empty region */
+   nregions = 0;
+   cut = s;
+   for (k = 0; k < nthreads && cut < s + len; k++) {
+      r = &regions[nregions++];
+      r->start = cut;
+      r->stream = s;
+      r->stream_end = s + len;
+      r->flags = flags;
+      cut = s + (long) ((double) len * (k + 1) / nthreads);
+      if (cut < r->start)
+	 cut = r->start;
+      if (k == nthreads - 1 ||
+	  (nl = memchr(cut, '\n', s + len - cut)) == NULL)
+	 cut = s + len;
+      else
+	 cut = nl + 1;
+      r->end = cut;
+   }
+
+   if (nregions > 1) {
+      run_regions(regions, nregions, scan_region);
+      in_string = 0;
+      depth = 0;
+      for (k = 0; k < nregions; k++) {
+	 regions[k].in_string = in_string;
+	 regions[k].depth = depth;
+	 depth += regions[k].parens[in_string];
+	 if (depth < 0)
+	    depth = 0;
+	 in_string ^= regions[k].quotes;
+      }
+   }
+   if (nregions > 0)
+      run_regions(regions, nregions, parse_region);
+
+   /* the regions' values, for as long as they join up */
+   for (k = 0; k < nregions; k++)
+      nvalues += regions[k].nvalues;
+   *values = (Value **) malloc((nvalues > 0 ? nvalues : 1) * sizeof(Value *));
+   nvalues = 0;
+   expect = nregions > 0 ? regions[0].first : s;
+   for (k = 0; k < nregions && !stopped; k++) {
+      r = &regions[k];
+      if (r->first != expect)
+	 break;
+      if (r->nvalues > 0)
+	 memcpy(*values + nvalues, r->values, r->nvalues * sizeof(Value *));
+      nvalues += r->nvalues;
+      r->nvalues = 0;
+      if (r->last_end != NULL)
+	 last_end = r->last_end;
+      expect = r->next;
+      stopped = r->failed;
+   }
+   for (n = 0; n < nregions; n++) {
+      for (i = 0; i < regions[n].nvalues; i++)
+	 free_value(regions[n].values[i]);
+      free(regions[n].values);
+   }
+
+   /* they did not: parse on from where the last one that did left off */
+   if (k < nregions && !stopped) {
+      memset(&tail, 0, sizeof(tail));
+      tail.stream = s;
+      tail.stream_end = s + len;
+      tail.flags = flags;
+      parse_from(&tail, expect, s + len);
+      *values = (Value **) realloc(*values, (nvalues + tail.nvalues + 1) *
+				   sizeof(Value *));
+      if (tail.nvalues > 0)
+	 memcpy(*values + nvalues, tail.values,
+		tail.nvalues * sizeof(Value *));
+      nvalues += tail.nvalues;
+      if (tail.last_end != NULL)
+	 last_end = tail.last_end;
+      free(tail.values);
+   }
+
+   free(regions);
+   *consumed = last_end != NULL ? last_end - s : 0;
+   return nvalues;
+}
@@ -0,0 +1,31 @@
+/*
+   lbulk.h  parse a stream of s-expressions on several threads
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+   vparse_bulk() reads every value in a stream of printed values, as
+   zrecv writes them or a batch file holds them, and returns the same
+   values in the same order as calling vparse() over and over would,
+   but parses different parts of the stream on different threads.
+   Include lread.h first.
+  */
+
+#ifndef LBULK_H
+#define LBULK_H
+
+extern long vparse_bulk(long len, char *s, int flags, int nthreads,
+			Value ***values, long *consumed);
+
+#endif /* LBULK_H */
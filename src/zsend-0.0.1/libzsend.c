@@ -0,0 +1,670 @@
+/*
+   libzsend.c  simple zephyr sender, as a library
+   Copyright (C) 1994 Darrell Kindred
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+*/
+
+#include <strings.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <zephyr/zephyr.h>
+#include <zephyr/zephyr_err.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "zsend.h"
+
+extern Code_t ZClosePort(), ZSendNotice(), ZInitialize(), ZOpenPort(),
+              ZSrvSendNotice(), ZSendPacket(), ZPending(), ZReceiveNotice(),
+              ZCompareUID(), ZFreeNotice(), ZSubscribeTo(),
+              ZCancelSubscriptions();
+#ifdef CMU_INTERREALM
+extern char *ZExpandRealm();
+#endif
+
+/* How long zsend_submit() waits for the host manager's HMACK. */
+#define HMACK_TIMEOUT_MS	(10 * 1000)
+#define PENDING_BUCKETS		1024
+
+#ifdef CMU_INTERREALM
+/* ZExpandRealm() may look in the configuration or the DNS, so its
+ * answers are kept this long. */
+#define REALM_TTL_SECS		(60 * 60)
+#define REALM_BUCKETS		64
+
+typedef struct RealmExpansion RealmExpansion;
+struct RealmExpansion {
+   char		*realm;		/* as given */
+   char		*expanded;
+   time_t	expires;
+   RealmExpansion *next;
+};
+#endif
+
+typedef struct ZSendRequest ZSendRequest;
+struct ZSendRequest {
+   int		nleft;		/* fragments not yet acknowledged */
+   Code_t	code;		/* first failure, or ZERR_NONE */
+   char		*failed_recipient;
+   ZSendDone	done;
+   void		*arg;
+};
+
+/* One packet sent by zsend_submit() and waiting for its HMACK. */
+typedef struct PendingReply PendingReply;
+struct PendingReply {
+   char *recipient;
+   ZUnique_Id_t	uid;
+   PendingReply *next;		/* hash chain */
+   PendingReply *older, *newer;	/* in order of deadline */
+   ZSendRequest	*req;
+   long long	deadline;	/* ms */
+};
+
+struct ZSendSession {
+   u_short	port;
+   int		zfd;
+
+   /* recipient of the notice zsend_send() failed on, if any */
+   const char	*failed_recipient;
+
+   /* messages sent which are waiting for replies, by uid and by age */
+   PendingReply *pending_replies[PENDING_BUCKETS];
+   PendingReply *oldest, *newest;
+   int		npending;
+
+   /* where zsend_receive() hands notices that are not acknowledgements */
+   ZSendReceiver receiver;
+   void		*receiver_arg;
+   int		subscribed;
+
+   int		authenticate;	/* send with ZAUTH */
+
+   /* the recipient being sent to, when it has to be rewritten */
+   char		*recip_buf;
+   int		recip_size;
+#ifdef CMU_INTERREALM
+   RealmExpansion *realms[REALM_BUCKETS];
+#endif
+};
+
+/* ZInitialize() sets up libzephyr's globals and may only be done once */
+static int initialized = 0;
+
+void
+zsend_default_fields(ZSendFields *f)
+{
+   bzero((char *) f, sizeof(*f));
+   f->class = DEFAULT_CLASS;
+   f->instance = DEFAULT_INSTANCE;
+   f->opcode = DEFAULT_OPCODE;
+   f->sender = NULL;
+   f->signature = "";
+   f->realm = NULL;
+   f->message = "";
+   f->message_len = -1;
+}
+
+Code_t
+zsend_open(ZSendSession **sp)
+{
+   ZSendSession *s;
+   Code_t retval;
+
+   *sp = NULL;
+   if (!initialized) {
+      if ((retval = ZInitialize()) != ZERR_NONE)
+	 return retval;
+      initialized = 1;
+   }
+
+   if ((s = (ZSendSession *) malloc(sizeof(*s))) == NULL)
+      return ENOMEM;
+   s->port = 0;
+   if ((retval = ZOpenPort(&s->port)) != ZERR_NONE) {
+      free(s);
+      return retval;
+   }
+   s->zfd = ZGetFD();
+   s->failed_recipient = NULL;
+   bzero((char *) s->pending_replies, sizeof(s->pending_replies));
+   s->oldest = s->newest = NULL;
+   s->npending = 0;
+   s->receiver = NULL;
+   s->receiver_arg = NULL;
+   s->subscribed = 0;
+   s->authenticate = 0;
+   s->recip_buf = NULL;
+   s->recip_size = 0;
+#ifdef CMU_INTERREALM
+   bzero((char *) s->realms, sizeof(s->realms));
+#endif
+   *sp = s;
+   return ZERR_NONE;
+}
+
+/* The message body of a notice is the signature and the text, each
+ * followed by a NUL. */
+static char *
+make_message(const ZSendFields *f, int *lenp)
+{
+   int siglen = strlen(f->signature);
+   int msglen = f->message_len < 0 ? strlen(f->message) : f->message_len;
+   char *buf;
+
+   if ((buf = (char *) malloc(siglen + msglen + 2)) == NULL)
+      return NULL;
+   memcpy(buf, f->signature, siglen + 1);
+   memcpy(buf + siglen + 1, f->message, msglen);
+   buf[siglen + 1 + msglen] = '\0';
+   *lenp = siglen + msglen + 2;
+   return buf;
+}
+
+static int
+missing_recipient(const ZSendFields *f, int broadcast)
+{
+   /* must specify recipient if using default class and
+      (default instance or urgent instance) */
+   return (broadcast && !(strcmp(f->class, DEFAULT_CLASS) ||
+			  (strcmp(f->instance, DEFAULT_INSTANCE) &&
+			   strcmp(f->instance, URGENT_INSTANCE))));
+}
+
+/* Send authenticated notices from now on, or stop.  The credentials
+ * and authenticator are fetched on the first authenticated send and
+ * reused until they are near expiry (see ZMkAuth.c), so after that an
+ * authenticated notice costs little more than an unauthenticated one. */
+void
+zsend_set_auth(ZSendSession *s, int authenticate)
+{
+   s->authenticate = authenticate;
+}
+
+#ifdef CMU_INTERREALM
+/* ZExpandRealm(realm), from the session's cache if we have asked
+ * recently.  NULL if out of memory. */
+static const char *
+expand_realm(ZSendSession *s, const char *realm)
+{
+   RealmExpansion *r, **rp;
+   unsigned h = 0;
+   const char *p;
+   time_t now = time(NULL);
+
+   for (p = realm; *p; p++)
+      h = h * 31 + (unsigned char) *p;
+   for (rp = &s->realms[h % REALM_BUCKETS]; (r = *rp) != NULL;
+	rp = &r->next)
+      if (!strcmp(r->realm, realm))
+	 break;
+   if (r != NULL && now < r->expires)
+      return r->expanded;
+
+   if (r == NULL) {
+      if ((r = (RealmExpansion *) calloc(1, sizeof(RealmExpansion))) == NULL ||
+	  (r->realm = strdup(realm)) == NULL) {
+	 free(r);
+	 return NULL;
+      }
+      r->next = NULL;
+      *rp = r;
+   }
+   free(r->expanded);
+   r->expanded = NULL;		/* in case strdup() fails */
+   /* ZExpandRealm() returns a static buffer */
+   if ((r->expanded = strdup((char *) ZExpandRealm((char *) realm))) == NULL)
+      return NULL;
+   r->expires = now + REALM_TTL_SECS;
+   return r->expanded;
+}
+
+static void
+free_realms(ZSendSession *s)
+{
+   RealmExpansion *r, *next;
+   int i;
+
+   for (i = 0; i < REALM_BUCKETS; i++)
+      for (r = s->realms[i]; r != NULL; r = next) {
+	 next = r->next;
+	 free(r->realm);
+	 free(r->expanded);
+	 free(r);
+      }
+}
+
+/* "<user>@<expanded realm>" in the session's recipient buffer. */
+static char *
+realm_recipient(ZSendSession *s, const char *user, int userlen,
+		const char *realm)
+{
+   const char *expanded;
+   int len;
+
+   if ((expanded = expand_realm(s, realm)) == NULL)
+      return NULL;
+   len = userlen + 1 + strlen(expanded) + 1;
+   if (len > s->recip_size) {
+      char *buf = (char *) realloc(s->recip_buf, len);
+      if (buf == NULL)
+	 return NULL;
+      s->recip_buf = buf;
+      s->recip_size = len;
+   }
+   memcpy(s->recip_buf, user, userlen);
+   s->recip_buf[userlen] = '@';
+   strcpy(s->recip_buf + userlen + 1, expanded);
+   return s->recip_buf;
+}
+#endif /* CMU_INTERREALM */
+
+/* Fill in notice for one recipient (NULL to broadcast).  An interrealm
+ * recipient is rewritten into the session's recipient buffer, which
+ * stays good until the next call.  Returns ENOMEM or ZERR_NONE. */
+static Code_t
+make_notice(ZSendSession *s, ZNotice_t *notice, const ZSendFields *f,
+	    const char *recip, char *msg, int msglen)
+{
+#ifdef CMU_INTERREALM
+   const char *cp;
+#endif
+
+   bzero((char *) notice, sizeof(*notice));
+
+   notice->z_kind = UNACKED;
+   notice->z_port = 0;
+   notice->z_class = (char *) f->class;
+   notice->z_opcode = (char *) f->opcode;
+   notice->z_sender = (char *) f->sender;
+   notice->z_class_inst = (char *) f->instance;
+#ifdef CMU_INTERREALM
+   if (recip != NULL && (cp = strchr(recip, '@'))) {
+     if ((notice->z_recipient = realm_recipient(s, recip, cp - recip,
+						cp + 1)) == NULL)
+       return ENOMEM;
+   } else if (f->realm != NULL) {
+     if ((notice->z_recipient = realm_recipient(s, "", 0,
+						f->realm)) == NULL)
+       return ENOMEM;
+   } else
+#endif
+   notice->z_recipient = (char *) (recip == NULL ? "" : recip);
+   notice->z_message = msg;
+   notice->z_message_len = msglen;
+   if (s->authenticate)
+      notice->z_default_format = "Class $class, Instance $instance:\nTo: @bold($recipient)\n$message";
+   else
+      notice->z_default_format = "@bold(UNAUTHENTIC) Class $class, Instance $instance:\n$message";
+   return ZERR_NONE;
+}
+
+/* Send one notice per recipient, or a single broadcast notice if there
+ * are none.  Stops at the first failure, whose recipient can be had
+ * from zsend_failed_recipient(). */
+Code_t
+zsend_send(ZSendSession *s, const ZSendFields *f,
+	   int n_recips, const char **recips)
+{
+   ZNotice_t notice;
+   Code_t retval = ZERR_NONE;
+   int broadcast = (n_recips == 0);
+   int (*auth)();
+   char *msg;
+   int msglen;
+   int i;
+
+   s->failed_recipient = NULL;
+
+   if (missing_recipient(f, broadcast))
+      return ZERR_ILLVAL;
+
+   if ((msg = make_message(f, &msglen)) == NULL)
+      return ENOMEM;
+
+   for (i = 0; broadcast || i < n_recips; i++) {
+      auth = s->authenticate ? ZAUTH : ZNOAUTH;
+      if ((retval = make_notice(s, &notice, f, broadcast ? NULL : recips[i],
+				msg, msglen)) != ZERR_NONE ||
+	  (retval = ZSendNotice(&notice, auth)) != ZERR_NONE) {
+	s->failed_recipient = broadcast ? "" : recips[i];
+	break;
+      }
+      if (broadcast)
+	break;
+   }
+   free(msg);
+   return retval;
+}
+
+/* Asynchronous sending.
+
+   zsend_submit() formats and transmits the packets for a notice but
+   does not wait for the host manager to acknowledge them, the way
+   ZSendNotice() does; it hands libzephyr a send routine that records
+   each packet's uid and calls ZSendPacket() without waiting.  The
+   HMACKs are picked up by zsend_receive() when the session's fd is
+   readable, and packets that go unacknowledged are failed by
+   zsend_expire().  When every packet of a submission is accounted for,
+   its done callback is called once with the outcome. */
+
+/* in 64 bits, as a 32-bit long of milliseconds wraps in 24 days */
+static long long
+now_ms(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000L;
+}
+
+static unsigned
+uid_hash(ZUnique_Id_t *uid)
+{
+   return ((unsigned) uid->tv.tv_sec * 1000003u ^ (unsigned) uid->tv.tv_usec ^
+	   (unsigned) uid->zuid_addr.s_addr) % PENDING_BUCKETS;
+}
+
+static PendingReply *
+find_pending(ZSendSession *s, ZUnique_Id_t *uid)
+{
+   PendingReply *p;
+
+   for (p = s->pending_replies[uid_hash(uid)]; p != NULL; p = p->next)
+      if (ZCompareUID(&p->uid, uid))
+	 return p;
+   return NULL;
+}
+
+/* Made before the packet goes out, so that running out of memory fails
+ * the send rather than losing track of a packet that was sent. */
+static PendingReply *
+new_pending(const char *recipient)
+{
+   PendingReply *p = (PendingReply *) malloc(sizeof(PendingReply));
+
+   if (p == NULL)
+      return NULL;
+   if ((p->recipient = strdup(recipient)) == NULL) {
+      free(p);
+      return NULL;
+   }
+   return p;
+}
+
+static void
+add_pending(ZSendSession *s, PendingReply *p, ZSendRequest *req,
+	    ZUnique_Id_t *uid)
+{
+   unsigned h = uid_hash(uid);
+
+   p->uid = *uid;
+   p->req = req;
+   p->deadline = now_ms() + HMACK_TIMEOUT_MS;
+   p->next = s->pending_replies[h];
+   s->pending_replies[h] = p;
+   p->newer = NULL;
+   p->older = s->newest;
+   if (s->newest != NULL)
+      s->newest->newer = p;
+   else
+      s->oldest = p;
+   s->newest = p;
+   s->npending++;
+   req->nleft++;
+}
+
+static void
+finish_request(ZSendSession *s, ZSendRequest *req)
+{
+   req->done(s, req->code, req->failed_recipient, req->arg);
+   free(req->failed_recipient);
+   free(req);
+}
+
+/* p has been acknowledged (code ZERR_NONE) or has failed. */
+static void
+resolve_pending(ZSendSession *s, PendingReply *p, Code_t code)
+{
+   PendingReply **pp;
+   ZSendRequest *req = p->req;
+
+   for (pp = &s->pending_replies[uid_hash(&p->uid)]; *pp != p;
+	pp = &(*pp)->next)
+      ;
+   *pp = p->next;
+   if (p->older != NULL)
+      p->older->newer = p->newer;
+   else
+      s->oldest = p->newer;
+   if (p->newer != NULL)
+      p->newer->older = p->older;
+   else
+      s->newest = p->older;
+   s->npending--;
+
+   if (code != ZERR_NONE && req->code == ZERR_NONE) {
+      req->code = code;
+      req->failed_recipient = strdup(p->recipient);
+   }
+   free(p->recipient);
+   free(p);
+   if (--req->nleft == 0)
+      finish_request(s, req);
+}
+
+/* libzephyr's send routine has no argument, so zsend_submit() leaves
+ * what it needs here for the duration of the ZSrvSendNotice() call. */
+static struct {
+   ZSendSession	*s;
+   ZSendRequest	*req;
+   const char	*recipient;
+} xmit_context;
+
+static Code_t
+xmit_nowait(ZNotice_t *notice, char *buf, int len, int waitforack)
+{
+   PendingReply *p = NULL;
+   Code_t retval;
+
+   if (waitforack && (p = new_pending(xmit_context.recipient)) == NULL)
+      return ENOMEM;
+   if ((retval = ZSendPacket(buf, len, 0)) != ZERR_NONE) {
+      if (p != NULL) {
+	 free(p->recipient);
+	 free(p);
+      }
+      return retval;
+   }
+   if (p != NULL)
+      add_pending(xmit_context.s, p, xmit_context.req, &notice->z_uid);
+   return ZERR_NONE;
+}
+
+/* Start sending a notice to each recipient (or one broadcast notice)
+ * and return without waiting for acknowledgements.  done is called
+ * later from zsend_receive() or zsend_expire() with the outcome, unless
+ * this returns an error, in which case nothing is outstanding, done
+ * will never be called and zsend_failed_recipient() says where it
+ * stopped. */
+Code_t
+zsend_submit(ZSendSession *s, const ZSendFields *f, int n_recips,
+	     const char **recips, ZSendDone done, void *arg)
+{
+   ZNotice_t notice;
+   ZSendRequest *req;
+   Code_t retval = ZERR_NONE;
+   int broadcast = (n_recips == 0);
+   int (*auth)();
+   char *msg;
+   int msglen;
+   int i;
+
+   s->failed_recipient = NULL;
+   if (missing_recipient(f, broadcast))
+      return ZERR_ILLVAL;
+   if ((msg = make_message(f, &msglen)) == NULL)
+      return ENOMEM;
+   if ((req = (ZSendRequest *) calloc(1, sizeof(ZSendRequest))) == NULL) {
+      free(msg);
+      return ENOMEM;
+   }
+   req->done = done;
+   req->arg = arg;
+   /* hold the request open until every recipient has been tried */
+   req->nleft = 1;
+
+   xmit_context.s = s;
+   xmit_context.req = req;
+   for (i = 0; broadcast || i < n_recips; i++) {
+      xmit_context.recipient = broadcast ? "" : recips[i];
+      auth = s->authenticate ? ZAUTH : ZNOAUTH;
+      if ((retval = make_notice(s, &notice, f, broadcast ? NULL : recips[i],
+				msg, msglen)) != ZERR_NONE ||
+	  (retval = ZSrvSendNotice(&notice, auth, xmit_nowait)) != ZERR_NONE) {
+	 req->code = retval;
+	 req->failed_recipient = strdup(xmit_context.recipient);
+	 s->failed_recipient = xmit_context.recipient;
+	 break;
+      }
+      if (broadcast)
+	 break;
+   }
+   free(msg);
+
+   if (--req->nleft == 0) {
+      if (req->code == ZERR_NONE)
+	 /* UNACKED notices always wait for an HMACK, so this is odd */
+	 finish_request(s, req);
+      else {
+	 /* nothing is outstanding; report the failure directly */
+	 retval = req->code;
+	 free(req->failed_recipient);
+	 free(req);
+	 return retval;
+      }
+   }
+   return ZERR_NONE;
+}
+
+/* Read everything waiting on the session's fd: acknowledgements
+ * resolve the packets they are for, and anything else goes to the
+ * receiver, if there is one, and is then freed.  ZPending() pulls in
+ * every packet that has arrived at once, so a burst is drained in one
+ * call.  Call when zsend_fd() is readable. */
+void
+zsend_receive(ZSendSession *s)
+{
+   ZNotice_t notice;
+   struct sockaddr_in from;
+   PendingReply *p;
+
+   while (ZPending() > 0) {
+      if (ZReceiveNotice(&notice, &from) != ZERR_NONE)
+	 break;
+      if ((notice.z_kind == HMACK || notice.z_kind == SERVACK ||
+	   notice.z_kind == SERVNAK) &&
+	  (p = find_pending(s, &notice.z_uid)) != NULL)
+	 resolve_pending(s, p, notice.z_kind == SERVNAK ? ZERR_SERVNAK
+						       : ZERR_NONE);
+      else if (s->receiver != NULL)
+	 s->receiver(s, &notice, &from, s->receiver_arg);
+      ZFreeNotice(&notice);
+   }
+}
+
+/* Milliseconds until the oldest unacknowledged packet times out, or -1
+ * if nothing is outstanding. */
+long
+zsend_timeout(ZSendSession *s)
+{
+   long long left;
+
+   if (s->oldest == NULL)
+      return -1;
+   left = s->oldest->deadline - now_ms();
+   return left > 0 ? (long) left : 0;
+}
+
+/* Fail every packet whose HMACK is overdue. */
+void
+zsend_expire(ZSendSession *s)
+{
+   long long now = now_ms();
+
+   while (s->oldest != NULL && s->oldest->deadline <= now)
+      resolve_pending(s, s->oldest, ZERR_HMDEAD);
+}
+
+int
+zsend_inflight(ZSendSession *s)
+{
+   return s->npending;
+}
+
+const char *
+zsend_failed_recipient(ZSendSession *s)
+{
+   return s->failed_recipient;
+}
+
+int
+zsend_fd(ZSendSession *s)
+{
+   return s->zfd;
+}
+
+/* Receiving.  Subscribe the session's port to the given triples; the
+ * notices that come in are passed to the receiver set with
+ * zsend_set_receiver() as zsend_receive() reads them.  The
+ * subscriptions are cancelled by zsend_close(). */
+Code_t
+zsend_subscribe(ZSendSession *s, ZSubscription_t *subs, int nsubs)
+{
+   Code_t retval;
+
+   if ((retval = ZSubscribeTo(subs, nsubs, s->port)) == ZERR_NONE)
+      s->subscribed = 1;
+   return retval;
+}
+
+void
+zsend_set_receiver(ZSendSession *s, ZSendReceiver receiver, void *arg)
+{
+   s->receiver = receiver;
+   s->receiver_arg = arg;
+}
+
+/* Close the session.  Anything still in flight is failed first. */
+void
+zsend_close(ZSendSession *s)
+{
+   if (s == NULL)
+      return;
+   while (s->oldest != NULL)
+      resolve_pending(s, s->oldest, ZERR_HMDEAD);
+   if (s->subscribed)
+      (void) ZCancelSubscriptions(s->port);
+   ZClosePort();
+#ifdef CMU_INTERREALM
+   free_realms(s);
+#endif
+   free(s->recip_buf);
+   free(s);
+}
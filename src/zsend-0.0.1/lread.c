@@ -24,11 +24,111 @@
  */
 
 #include <setjmp.h>
+#include <limits.h>
 
 #include "lread.h"
 #include <stdio.h>
 #include <string.h> 	/* for strlen() */
 
+#ifdef LREAD_STATS
+/* The counters are shared by every thread parsing, so they are updated
+ * atomically; allocations by this thread alone, for per-parse counts,
+ * need not be. */
+#define STAT_ADD(field, n) __atomic_add_fetch(&stats.field, (n), \
+					      __ATOMIC_RELAXED)
+
+static VStats stats;
+static __thread long thread_allocs;
+
+static long node_bytes(Value *v);
+
+static int
+size_bucket(long length)
+{
+   int b = 0;
+
+   while (b < VSTATS_BUCKETS - 1 && length >= (1L << b))
+      b++;
+   return b;
+}
+
+/* v has just been allocated, and owns extra bytes of its caller's too */
+static void
+count_new(Value *v, long extra)
+{
+   long bytes = node_bytes(v) + extra;
+   long now = STAT_ADD(bytes, bytes);
+   long peak = __atomic_load_n(&stats.peak_bytes, __ATOMIC_RELAXED);
+
+   while (now > peak &&
+	  !__atomic_compare_exchange_n(&stats.peak_bytes, &peak, now, 1,
+				       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      ;
+   STAT_ADD(nodes, 1);
+   STAT_ADD(allocs, 1);
+   thread_allocs++;
+   if (v->tag == string || v->tag == symbol) {
+      STAT_ADD(string_bytes, VSLENGTH(v));
+      STAT_ADD(strings[size_bucket(VSLENGTH(v))], 1);
+   }
+}
+
+/* v is about to be freed, with extra bytes of its caller's */
+static void
+count_free(Value *v, long extra)
+{
+   STAT_ADD(bytes, -(node_bytes(v) + extra));
+   STAT_ADD(nodes, -1);
+   if (v->tag == string || v->tag == symbol)
+      STAT_ADD(string_bytes, -(long) VSLENGTH(v));
+}
+
+#define COUNT_NEW(v, extra)	count_new((v), (extra))
+#define COUNT_FREE(v, extra)	count_free((v), (extra))
+
+/* A copy of the counters.  Concurrent parses may be half counted. */
+void
+vstats(VStats *s)
+{
+   int b;
+
+   s->nodes = __atomic_load_n(&stats.nodes, __ATOMIC_RELAXED);
+   s->bytes = __atomic_load_n(&stats.bytes, __ATOMIC_RELAXED);
+   s->string_bytes = __atomic_load_n(&stats.string_bytes, __ATOMIC_RELAXED);
+   s->peak_bytes = __atomic_load_n(&stats.peak_bytes, __ATOMIC_RELAXED);
+   s->allocs = __atomic_load_n(&stats.allocs, __ATOMIC_RELAXED);
+   s->parses = __atomic_load_n(&stats.parses, __ATOMIC_RELAXED);
+   s->parse_allocs = __atomic_load_n(&stats.parse_allocs, __ATOMIC_RELAXED);
+   s->extracts = __atomic_load_n(&stats.extracts, __ATOMIC_RELAXED);
+   s->extract_bytes = __atomic_load_n(&stats.extract_bytes,
+				      __ATOMIC_RELAXED);
+   for (b = 0; b < VSTATS_BUCKETS; b++)
+      s->strings[b] = __atomic_load_n(&stats.strings[b], __ATOMIC_RELAXED);
+}
+
+/* Zero the running totals, and start the peak again from what is live;
+ * what is live is left alone. */
+void
+vstats_reset(void)
+{
+   int b;
+
+   __atomic_store_n(&stats.peak_bytes,
+		    __atomic_load_n(&stats.bytes, __ATOMIC_RELAXED),
+		    __ATOMIC_RELAXED);
+   __atomic_store_n(&stats.allocs, 0, __ATOMIC_RELAXED);
+   __atomic_store_n(&stats.parses, 0, __ATOMIC_RELAXED);
+   __atomic_store_n(&stats.parse_allocs, 0, __ATOMIC_RELAXED);
+   __atomic_store_n(&stats.extracts, 0, __ATOMIC_RELAXED);
+   __atomic_store_n(&stats.extract_bytes, 0, __ATOMIC_RELAXED);
+   for (b = 0; b < VSTATS_BUCKETS; b++)
+      __atomic_store_n(&stats.strings[b], 0, __ATOMIC_RELAXED);
+}
+#else
+#define COUNT_NEW(v, extra)
+#define COUNT_FREE(v, extra)
+#endif
+
 Value *
 vmake_cons(Value *car, Value *cdr)
 {
@@ -36,6 +136,7 @@ vmake_cons(Value *car, Value *cdr)
    v->tag = cons;
    VCAR(v) = car;
    VCDR(v) = cdr;
+   COUNT_NEW(v, 0);
    return v;
 }
 
@@ -44,8 +145,10 @@ vmake_symbol(int length, char *data)
 {
    Value *v = ALLOC_VALUE();
    v->tag = symbol;
-   VSLENGTH(v) = length;
-   VSDATA(v) = data;
+   v->sflags = 0;
+   v->value.s.length = length;
+   v->value.s.string = data;
+   COUNT_NEW(v, length + 1);
    return v;
 }
 
@@ -54,8 +157,10 @@ vmake_symbol_c(char *s)
 {
    Value *v = ALLOC_VALUE();
    v->tag = symbol;
-   VSLENGTH(v) = strlen(s);
-   VSDATA(v) = s;
+   v->sflags = 0;
+   v->value.s.length = strlen(s);
+   v->value.s.string = s;
+   COUNT_NEW(v, v->value.s.length + 1);
    return v;
 }
 
@@ -64,8 +169,10 @@ vmake_string(int length, char *data)
 {
    Value *v = ALLOC_VALUE();
    v->tag = string;
-   VSLENGTH(v) = length;
-   VSDATA(v) = data;
+   v->sflags = 0;
+   v->value.s.length = length;
+   v->value.s.string = data;
+   COUNT_NEW(v, length + 1);
    return v;
 }
 
@@ -74,8 +181,10 @@ vmake_string_c(char *s)
 {
    Value *v = ALLOC_VALUE();
    v->tag = string;
-   VSLENGTH(v) = strlen(s);
-   VSDATA(v) = s;
+   v->sflags = 0;
+   v->value.s.length = strlen(s);
+   v->value.s.string = s;
+   COUNT_NEW(v, v->value.s.length + 1);
    return v;
 }
 
@@ -83,20 +192,62 @@ char *
 vextract_string_c(Value *v)
 {
    char *s = (char *) malloc(VSLENGTH(v) + 1);
+#ifdef LREAD_STATS
+   STAT_ADD(extracts, 1);
+   STAT_ADD(extract_bytes, VSLENGTH(v) + 1);
+#endif
    memcpy(s, VSDATA(v), VSLENGTH(v));
    s[VSLENGTH(v)] = '\0';
    return s;
 }
 
-Value *
-vmake_integer(int n)
+/* A string or symbol with its own copy of the bytes, NUL-terminated:
+ * inside the node if they fit, and if not in the same block. */
+static Value *
+copy_string(enum Vtag tag, int length, const char *data)
 {
-   Value *v = ALLOC_VALUE();
+   Value *v;
+
+   if (length <= VSHORT_MAX) {
+      v = ALLOC_VALUE();
+      v->sflags = VS_SHORT;
+      v->slength = length;
+      memcpy(v->value.chars, data, length);
+      v->value.chars[length] = '\0';
+   }
+   else {
+      v = (Value *) malloc(sizeof(Value) + length + 1);
+      v->sflags = VS_TAIL;
+      v->value.s.length = length;
+      v->value.s.string = (char *) (v + 1);
+      memcpy(v->value.s.string, data, length);
+      v->value.s.string[length] = '\0';
+   }
+   v->tag = tag;
+   COUNT_NEW(v, 0);
+   return v;
+}
+
+static Value *
+make_integer(long n)
+{
+   Value *v;
+
+   if (VFIXNUM_FITS(n))
+      return VFIXNUM(n);
+   v = ALLOC_VALUE();
    v->tag = integer;
-   VINTEGER(v) = n;
+   v->value.integer.i = n;
+   COUNT_NEW(v, 0);
    return v;
 }
 
+Value *
+vmake_integer(int n)
+{
+   return make_integer(n);
+}
+
 Value *
 vmake_var(enum Vtag tag, void **value)
 {
@@ -104,6 +255,25 @@ vmake_var(enum Vtag tag, void **value)
    v->tag = var;
    VVTAG(v) = tag;
    VVDATA(v) = value;
+   COUNT_NEW(v, 0);
+   return v;
+}
+
+/* the slot after a vector's items: the list vector_rest() made */
+#define VECREST(v)	(VECITEMS(v)[VECLENGTH(v)])
+
+/* The items are copied, so the caller keeps its array. */
+Value *
+vmake_vector(int length, Value **items)
+{
+   Value *v = ALLOC_VECTOR(length);
+   v->tag = vector;
+   v->sflags = 0;
+   VECLENGTH(v) = length;
+   VECITEMS(v) = (Value **) (v + 1);
+   memcpy(VECITEMS(v), items, length * sizeof(Value *));
+   VECREST(v) = NULL;
+   COUNT_NEW(v, 0);
    return v;
 }
 
@@ -111,11 +281,168 @@ int
 vlength(Value *l)
 {
     int i;
+    if (VTAG(l) == vector)
+	return VECLENGTH(l);
     for (i=0; VTAG(l) == cons; i++, l = VCDR(l))
 	;
     return i;
 }
 
+/* Lazy vectors.  The index follows the items, and the VECREST() slot,
+ * in the vector's block; the items start out as VUNREAD. */
+typedef struct {
+   char *text;			/* what the vector was read from */
+   int flags;			/* to read the items with, less VPARSE_LAZY */
+   struct { int start, length; } span[1];	/* one per item */
+} LazyIndex;
+
+#define LAZY_INDEX(v)	((LazyIndex *) (VECITEMS(v) + VECLENGTH(v) + 1))
+#define ALLOC_LAZY(n)	((Value *) malloc(sizeof(Value) + \
+					  ((n) + 1) * sizeof(Value *) + \
+					  sizeof(LazyIndex) + \
+					  ((n) - 1) * sizeof(int [2])))
+/* sflags of a vector with a LazyIndex */
+#define VV_LAZY		1
+#define VV_BAD		2	/* ... an item of which did not parse */
+
+Value vunread = { any };
+
+#ifdef LREAD_STATS
+/* The size of the block v heads. */
+static long
+node_bytes(Value *v)
+{
+   switch (v->tag) {
+    case string:
+    case symbol:
+      if (v->sflags & VS_TAIL)
+	 return sizeof(Value) + VSLENGTH(v) + 1;
+      break;
+    case vector:
+      if (v->sflags & VV_LAZY)
+	 return sizeof(Value) + (VECLENGTH(v) + 1) * sizeof(Value *) +
+	    sizeof(LazyIndex) + (VECLENGTH(v) - 1) * sizeof(int [2]);
+      return sizeof(Value) + (VECLENGTH(v) + 1) * sizeof(Value *);
+    default:
+      break;
+   }
+   return sizeof(Value);
+}
+#endif
+
+/* Read item i of a lazy vector, the first time it is wanted.  The scan
+ * that found it checks only brackets and quotes, so an item can turn
+ * out not to parse: it reads as nil, and the vector is marked for
+ * vforce_failed(). */
+Value *
+vforce(Value *v, int i)
+{
+   LazyIndex *lz = LAZY_INDEX(v);
+   Value *item;
+
+   /* an atom is read up to the character after it, which is there:
+    * at the least, the vector's closing paren */
+   if (vparse(lz->span[i].length + 1, lz->text + lz->span[i].start,
+	      &item, lz->flags) <= 0) {
+      item = NULL;
+      v->sflags |= VV_BAD;
+   }
+   return VECITEMS(v)[i] = item;
+}
+
+/* Whether any item of v read so far was not a valid s-expression. */
+int
+vforce_failed(Value *v)
+{
+   return VTAG(v) == vector && (v->sflags & VV_BAD);
+}
+
+/* The items of v from i on, as a proper list, or NULL if it cannot be
+ * made.  The list is one block of conses over the whole vector, made
+ * the first time it is wanted and freed with v; a later call for
+ * another i returns another tail of it. */
+static Value *
+vector_rest(Value *v, int i)
+{
+   Value *rest = VECREST(v);
+   int n = VECLENGTH(v), k;
+
+   if (rest == NULL) {
+      if ((rest = (Value *) malloc(n * sizeof(Value))) == NULL)
+	 return NULL;
+      for (k = 0; k < n; k++) {
+	 rest[k].tag = cons;
+	 rest[k].value.cons.car = VECREF(v, k);
+	 rest[k].value.cons.cdr = k + 1 < n ? &rest[k + 1] : NULL;
+      }
+      COUNT_NEW(rest, (n - 1) * sizeof(Value));
+      VECREST(v) = rest;
+   }
+   return &rest[i];
+}
+
+/* Free the list vector_rest() made for v, if it made one. */
+static void
+free_rest(Value *v)
+{
+   Value *rest = VECREST(v);
+
+   if (rest != NULL) {
+      COUNT_FREE(rest, (VECLENGTH(v) - 1) * sizeof(Value));
+      free(rest);
+   }
+}
+
+/* Whether unread item i of a lazy vector might be a pair with key as
+ * its car, going by its text alone.  Only symbol keys are checked; if
+ * the text has an escape in the way, it might. */
+static int
+lazy_may_have_key(Value *v, int i, Value *key)
+{
+   LazyIndex *lz = LAZY_INDEX(v);
+   char *p = lz->text + lz->span[i].start;
+   char *end = p + lz->span[i].length;
+   char *atom;
+
+   if (VTAG(key) != symbol || VSLENGTH(key) == 0)
+      return 1;
+   if (*p++ != '(')
+      return 0;				/* not a list at all */
+   while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\0'))
+      p++;
+   for (atom = p; p < end; p++) {
+      switch (*p) {
+       case ' ':
+       case '\t':
+       case '\n':
+       case '\0':
+       case '\"':
+       case '(':
+       case ')':
+       case '.':
+	 goto done;
+       case '\\':
+	 return 1;
+      }
+   }
+ done:
+   return (p - atom == VSLENGTH(key) &&
+	   0 == memcmp(atom, VSDATA(key), VSLENGTH(key)));
+}
+
+/* The i'th element of a list or vector, or NULL if there is none. */
+Value *
+vref(Value *l, int i)
+{
+   if (i < 0)
+      return NULL;
+   if (VTAG(l) == vector)
+      return i < VECLENGTH(l) ? VECREF(l, i) : NULL;
+   while (i-- > 0 && VTAG(l) == cons)
+      l = VCDR(l);
+   return VTAG(l) == cons ? VCAR(l) : NULL;
+}
+
 typedef struct {
    jmp_buf abort;		/* nonlocal exit for abort */
 
@@ -125,10 +452,21 @@ typedef struct {
 
    int strbuflen;		/* length of scratch buffer */
    char *strbuf;		/* scratch buffer for building strings */
+   char scratch[128];		/* ... until it outgrows this */
+
+   int flags;			/* VPARSE_* */
+   Value **stack;		/* elements of the vectors being read */
+   int nstack;
+   int maxstack;
+   int *spans;			/* start and length of each lazy item */
+   int nspans;
+   int maxspans;
 } Globals;
 
 Value *read_value(Globals *g);
 Value *read_list(Globals *g);
+Value *read_vector(Globals *g);
+Value *read_lazy(Globals *g);
 
 #define PEEK_CHAR(g)	(*(g)->buf)
 #define NEXT_CHAR(g)	((g)->buflen > 0 ? \
@@ -146,24 +484,39 @@ void
 expand_strbuf(Globals *g)
 {
    if (g->strbuflen == 0) {
-      g->strbuflen = 128;
-      g->strbuf = (char *) malloc(g->strbuflen);
+      g->strbuflen = sizeof(g->scratch);
+      g->strbuf = g->scratch;
    }
    else {
       int newbuflen = 3 * g->strbuflen / 2;
       char *newbuf = (char *) malloc(newbuflen);
       memcpy(newbuf, g->strbuf, g->strbuflen);
-      free(g->strbuf);
+      if (g->strbuf != g->scratch)
+	 free(g->strbuf);
       g->strbuf = newbuf;
       g->strbuflen = newbuflen;
    }
 }
 
 int parse(int slen, char *s, Value **v)
+{
+   return vparse(slen, s, v, 0);
+}
+
+/* parse(), with flags saying how to build the result. */
+int vparse(int slen, char *s, Value **v, int flags)
 {
    Globals g;
    int jmpret;
+#ifdef LREAD_STATS
+   long allocs = thread_allocs;
+#endif
 
+   g.flags = flags;
+   g.stack = NULL;
+   g.nstack = g.maxstack = 0;
+   g.spans = NULL;
+   g.nspans = g.maxspans = 0;
    if (0 == (jmpret = setjmp(g.abort))) {	/* successful parse */
       g.input_string = s;
       g.buflen = slen;
@@ -172,10 +525,21 @@ int parse(int slen, char *s, Value **v)
       g.strbuf = NULL;
       expand_strbuf(&g);
       *v = read_value(&g);
+#ifdef LREAD_STATS
+      STAT_ADD(parses, 1);
+      STAT_ADD(parse_allocs, thread_allocs - allocs);
+#endif
+      if (g.strbuf != g.scratch)
+	 free(g.strbuf);
+      free(g.stack);
+      free(g.spans);
       return g.buf - g.input_string;
    }
    else {			/* return from nonlocal abort */
-      free(g.strbuf);
+      if (g.strbuf != g.scratch)
+	 free(g.strbuf);
+      free(g.stack);
+      free(g.spans);
       *v = NULL;
       return 0;
    }
@@ -228,24 +592,19 @@ Value *
 read_string(Globals *g)
 {
    int strpos = 0;
-   Value *v;
    char c;
 
-#define ADD_CHAR(c)	\
-   if (strpos >= g->strbuflen) \
+#define ADD_CHAR(c)	do {		\
+   if (strpos >= g->strbuflen)	\
       expand_strbuf(g);		\
-   g->strbuf[strpos++] = (c)
+   g->strbuf[strpos++] = (c);	\
+} while (0)
 
    while (1) {
       switch (PEEK_CHAR(g)) {
        case '\"':
 	 NEXT_CHAR(g);
-	 v = ALLOC_VALUE();
-	 v->tag = string;
-	 v->value.s.length = strpos;
-	 v->value.s.string = (char *) malloc(v->value.s.length);
-	 memcpy(v->value.s.string, g->strbuf, v->value.s.length);
-	 return v;
+	 return copy_string(string, strpos, g->strbuf);
 	 break;
        case '\\':
 	 NEXT_CHAR(g);
@@ -278,10 +637,11 @@ read_num_or_symbol(Globals *g)
    int i;
    int is_integer;
 
-#define ADD_CHAR(c)	\
-   if (strpos >= g->strbuflen) \
+#define ADD_CHAR(c)	do {		\
+   if (strpos >= g->strbuflen)	\
       expand_strbuf(g);		\
-   g->strbuf[strpos++] = (c)
+   g->strbuf[strpos++] = (c);	\
+} while (0)
 
    while (g->buflen > 0) {
       switch (PEEK_CHAR(g)) {
@@ -336,10 +696,8 @@ read_num_or_symbol(Globals *g)
 
    if (is_integer) {
       /* it's an integer */
-      v = ALLOC_VALUE();
-      v->tag = integer;
       ADD_CHAR('\0');
-      v->value.integer.i = atoi(g->strbuf);
+      v = vmake_integer(atoi(g->strbuf));
    }
    else {
       /* it's a symbol */
@@ -347,11 +705,7 @@ read_num_or_symbol(Globals *g)
 	  !memcmp(g->strbuf, "nil", 3)) {
 	 v = NULL;
       } else {
-	 v = ALLOC_VALUE();
-	 v->tag = symbol;
-	 v->value.s.length = strpos;
-	 v->value.s.string = (char *) malloc(v->value.s.length);
-	 memcpy(v->value.s.string, g->strbuf, v->value.s.length);
+	 v = copy_string(symbol, strpos, g->strbuf);
       }
    }
    return v;
@@ -374,6 +728,12 @@ read_value(Globals *g)
 	 break;
        case '(':
 	 NEXT_CHAR(g);
+	 if (g->flags & VPARSE_LAZY) {
+	    g->flags &= ~VPARSE_LAZY;	/* only the outermost list */
+	    return read_lazy(g);
+	 }
+	 if (g->flags & VPARSE_VECTORS)
+	    return read_vector(g);
 	 return read_list(g);
 	 break;
        case ')':
@@ -432,14 +792,213 @@ read_list(Globals *g)
 	 *tail = ALLOC_VALUE();
 	 (*tail)->tag = cons;
 	 (*tail)->value.cons.car = v;
+	 COUNT_NEW(*tail, 0);
 	 tail = &(*tail)->value.cons.cdr;
       }
    }
    ABORT(g, 23);	/* added this  -dkindred */
 }
 
+static void
+push_value(Globals *g, Value *v)
+{
+   if (g->nstack == g->maxstack) {
+      g->maxstack = g->maxstack ? 2 * g->maxstack : 64;
+      g->stack = (Value **) realloc(g->stack, g->maxstack * sizeof(Value *));
+   }
+   g->stack[g->nstack++] = v;
+}
+
+/* read_list() for VPARSE_VECTORS.  Elements are gathered on g->stack,
+ * above those of any vector we are inside, and copied out once the
+ * length is known.  A dotted list is still built of conses. */
+Value *
+read_vector(Globals *g)
+{
+   int base = g->nstack;
+   Value *v, *tail = NULL;
+   int dotted = 0;
+
+   while (g->buflen > 0) {
+      if (NULL == (v = read_value(g))) {
+	 switch (PEEK_CHAR(g)) {
+
+	  case ')':
+	    NEXT_CHAR(g);
+	    if (dotted) {
+	       while (g->nstack > base)
+		  tail = vmake_cons(g->stack[--g->nstack], tail);
+	       v = tail;
+	    }
+	    else if (g->nstack > base)
+	       v = vmake_vector(g->nstack - base, g->stack + base);
+	    g->nstack = base;
+	    return v;
+	    break;
+
+	  case '.':			/* set last cdr explicitly */
+	    NEXT_CHAR(g);
+	    if (dotted || g->nstack == base ||
+		NULL == (tail = read_value(g)))
+	       ABORT(g, 13);
+	    dotted = 1;
+	    break;
+
+	  default:
+	    /* badly formed input ??? */
+	    ABORT(g, 13);
+	    break;
+	 }
+      }
+      else {
+	 if (dotted) {
+	    /* two values after a . in a list.  very bad! ??? */
+	    ABORT(g, 13);
+	 }
+	 push_value(g, v);
+      }
+   }
+   ABORT(g, 23);
+}
+
+/* Step over one element without reading it: a string, an atom, or a
+ * list and everything in it.  Returns its length. */
+static int
+skip_element(Globals *g)
+{
+   char *start = g->buf, *p = g->buf, *end = g->buf + g->buflen;
+   int depth = 0;
+
+   if (*p != '(' && *p != '\"') {
+      /* an atom, which runs to a delimiter as in read_num_or_symbol() */
+      for (;; p++) {
+	 if (p >= end)
+	    ABORT(g, 23);
+	 switch (*p) {
+	  case ' ':
+	  case '\t':
+	  case '\n':
+	  case '\0':
+	  case '\"':
+	  case '(':
+	  case ')':
+	  case '.':
+	    goto done;
+	  case '\\':
+	    p++;
+	    break;
+	 }
+      }
+   }
+   do {
+      if (p >= end)
+	 ABORT(g, 23);
+      switch (*p++) {
+       case '\"':
+	 for (; p < end && *p != '\"'; p++)
+	    if (*p == '\\')
+	       p++;
+	 if (p++ >= end)
+	    ABORT(g, 23);
+	 break;
+       case '(':
+	 depth++;
+	 break;
+       case ')':
+	 depth--;
+	 break;
+       case '\\':
+	 p++;
+	 break;
+      }
+   } while (depth > 0);
+   if (p > end)
+      ABORT(g, 23);
+ done:
+   g->buflen -= p - start;
+   g->buf = p;
+   return p - start;
+}
+
+static void
+push_span(Globals *g, int start, int length)
+{
+   if (g->nspans + 2 > g->maxspans) {
+      g->maxspans = g->maxspans ? 2 * g->maxspans : 128;
+      g->spans = (int *) realloc(g->spans, g->maxspans * sizeof(int));
+   }
+   g->spans[g->nspans++] = start;
+   g->spans[g->nspans++] = length;
+}
+
+/* read_list() for VPARSE_LAZY.  The elements are only stepped over,
+ * and where each one lies is kept in the index of the vector returned,
+ * for vforce() to read it in full when it is first wanted.  A dotted
+ * list is read in full now, as it would be without the flag. */
+Value *
+read_lazy(Globals *g)
+{
+   char *list = g->buf;
+   int listlen = g->buflen;
+   LazyIndex *lz;
+   Value *v;
+   int n, i;
+
+   g->nspans = 0;
+   while (g->buflen > 0) {
+      switch (PEEK_CHAR(g)) {
+       case ' ':
+       case '\t':
+       case '\n':
+       case '\0':
+	 NEXT_CHAR(g);
+	 break;
+
+       case ')':
+	 NEXT_CHAR(g);
+	 if ((n = g->nspans / 2) == 0)
+	    return NULL;
+	 v = ALLOC_LAZY(n);
+	 v->tag = vector;
+	 v->sflags = VV_LAZY;
+	 VECLENGTH(v) = n;
+	 VECITEMS(v) = (Value **) (v + 1);
+	 VECREST(v) = NULL;
+	 lz = LAZY_INDEX(v);
+	 lz->text = g->input_string;
+	 lz->flags = g->flags;
+	 for (i = 0; i < n; i++) {
+	    VECITEMS(v)[i] = VUNREAD;
+	    lz->span[i].start = g->spans[2 * i];
+	    lz->span[i].length = g->spans[2 * i + 1];
+	 }
+	 COUNT_NEW(v, 0);
+	 return v;
+	 break;
+
+       case '.':			/* start again, the ordinary way */
+	 g->buf = list;
+	 g->buflen = listlen;
+	 if (g->flags & VPARSE_VECTORS)
+	    return read_vector(g);
+	 return read_list(g);
+	 break;
+
+       default:
+	 i = g->buf - g->input_string;
+	 push_span(g, i, skip_element(g));
+	 break;
+      }
+   }
+   ABORT(g, 23);
+}
+
 void free_value(Value *v)
 {
+   int i;
+
+   if (v == NULL || VFIXNUMP(v))
+      return;
    switch(VTAG(v)) {
     case cons:
       free_value(v->value.cons.car);
@@ -447,11 +1006,23 @@ void free_value(Value *v)
       break;
     case string:
     case symbol:
-      free(v->value.s.string);
+      if (!(v->sflags & (VS_SHORT | VS_TAIL))) {
+	 COUNT_FREE(v, v->value.s.length + 1);
+	 free(v->value.s.string);
+	 free(v);
+	 return;
+      }
+      break;
+    case vector:			/* without reading lazy items */
+      for (i = 0; i < VECLENGTH(v); i++)
+	 if (VECITEMS(v)[i] != VUNREAD)
+	    free_value(VECITEMS(v)[i]);
+      free_rest(v);
       break;
     default:
       break;
    }
+   COUNT_FREE(v, 0);
    free(v);
 }
 
@@ -483,6 +1054,8 @@ prinlis(FILE *f, Value *v, int first)
 void
 prin(FILE *f, Value *v)
 {
+   int i;
+
    switch (VTAG(v)) {
     case nil:
       fputs("\'()", f);
@@ -494,15 +1067,24 @@ prin(FILE *f, Value *v)
     case string:
       /* ??? do quoting of '"' ??? */
       putc('\"', f);
-      fwrite(v->value.s.string, 1, v->value.s.length, f);
+      fwrite(VSDATA(v), 1, VSLENGTH(v), f);
       putc('\"', f);
       break;
     case symbol:
       /* ??? do quoting of all whitespace and special chars ??? */
-      fwrite(v->value.s.string, 1, v->value.s.length, f);
+      fwrite(VSDATA(v), 1, VSLENGTH(v), f);
       break;
     case integer:
-      fprintf(f, "%ld", v->value.integer.i);
+      fprintf(f, "%ld", VINTEGER(v));
+      break;
+    case vector:			/* printed as the list it was read from */
+      putc('(', f);
+      for (i = 0; i < VECLENGTH(v); i++) {
+	 if (i > 0)
+	    putc(' ', f);
+	 prin(f, VECREF(v, i));
+      }
+      putc(')', f);
       break;
     default:
       fputs("#<huh?>", f);
@@ -510,13 +1092,383 @@ prin(FILE *f, Value *v)
    }
 }
 
+/* Binary encoding.
+
+   A compact alternative to printed s-expressions for trusted local
+   peers.  An encoded value is framed as
+
+      VBIN_MAGIC <varint body length> <body>
+
+   and a body is one of
+
+      VB_NIL
+      VB_LIST <varint n> <n values> <tail value>
+      VB_STRING <varint length> <bytes> '\0'
+      VB_SYMBOL <varint length> <bytes> '\0'
+      VB_INTEGER <zigzag varint>
+
+   Vectors are encoded as the proper lists they stand for.
+
+   Varints are little-endian base 128.  Strings carry a trailing NUL
+   that is not counted in their length, so that a buffer decoded in
+   place yields strings usable as C strings without copying. */
+
+#define VB_NIL		0
+#define VB_LIST		1
+#define VB_STRING	2
+#define VB_SYMBOL	3
+#define VB_INTEGER	4
+
+static int
+varint_size(unsigned long n)
+{
+   int size = 1;
+
+   while (n >= 0x80) {
+      n >>= 7;
+      size++;
+   }
+   return size;
+}
+
+static char *
+put_varint(char *p, unsigned long n)
+{
+   while (n >= 0x80) {
+      *p++ = (char) (n | 0x80);
+      n >>= 7;
+   }
+   *p++ = (char) n;
+   return p;
+}
+
+#define ZIGZAG(i)	(((unsigned long) (i) << 1) ^ (unsigned long) ((i) < 0 ? -1L : 0L))
+#define UNZIGZAG(n)	((long) ((n) >> 1) ^ -(long) ((n) & 1))
+
+static long
+encoded_size(Value *v)
+{
+   long size = 0, item;
+   int n = 0;
+
+   switch (VTAG(v)) {
+    case nil:
+      return 1;
+    case vector:
+      for (; n < VECLENGTH(v); n++) {
+	 if ((item = encoded_size(VECREF(v, n))) < 0)
+	    return -1;
+	 size += item;
+      }
+      return 1 + varint_size(n) + size + 1;
+    case cons:
+      for (; VTAG(v) == cons; v = VCDR(v), n++) {
+	 if ((item = encoded_size(VCAR(v))) < 0)
+	    return -1;
+	 size += item;
+      }
+      if ((item = encoded_size(v)) < 0)
+	 return -1;
+      return 1 + varint_size(n) + size + item;
+    case string:
+    case symbol:
+      return 1 + varint_size(VSLENGTH(v)) + VSLENGTH(v) + 1;
+    case integer:
+      return 1 + varint_size(ZIGZAG(VINTEGER(v)));
+    default:
+      return -1;
+   }
+}
+
+static char *
+encode_value(Value *v, char *p)
+{
+   Value *l;
+   int n;
+
+   switch (VTAG(v)) {
+    case nil:
+      *p++ = VB_NIL;
+      break;
+    case cons:
+      for (n = 0, l = v; VTAG(l) == cons; l = VCDR(l))
+	 n++;
+      *p++ = VB_LIST;
+      p = put_varint(p, n);
+      for (; VTAG(v) == cons; v = VCDR(v))
+	 p = encode_value(VCAR(v), p);
+      p = encode_value(v, p);
+      break;
+    case vector:
+      *p++ = VB_LIST;
+      p = put_varint(p, VECLENGTH(v));
+      for (n = 0; n < VECLENGTH(v); n++)
+	 p = encode_value(VECREF(v, n), p);
+      *p++ = VB_NIL;
+      break;
+    case string:
+    case symbol:
+      *p++ = VTAG(v) == string ? VB_STRING : VB_SYMBOL;
+      p = put_varint(p, VSLENGTH(v));
+      memcpy(p, VSDATA(v), VSLENGTH(v));
+      p += VSLENGTH(v);
+      *p++ = '\0';
+      break;
+    case integer:
+      *p++ = VB_INTEGER;
+      p = put_varint(p, ZIGZAG(VINTEGER(v)));
+      break;
+    default:
+      break;
+   }
+   return p;
+}
+
+/* Encode v into a freshly malloc'd buffer.  Returns the encoded length,
+ * or -1 if v holds something that cannot be encoded (a var). */
+int
+vencode(Value *v, char **bufp)
+{
+   long body = encoded_size(v);
+   char *p;
+
+   *bufp = NULL;
+   if (body < 0 || body > 0x7fffffffL - 16)
+      return -1;
+   if ((p = *bufp = (char *) malloc(1 + varint_size(body) + body)) == NULL)
+      return -1;
+   *p++ = (char) VBIN_MAGIC;
+   p = put_varint(p, body);
+   p = encode_value(v, p);
+   return p - *bufp;
+}
+
+typedef struct {
+   jmp_buf abort;		/* nonlocal exit for invalid input */
+   unsigned char *p;
+   unsigned char *end;
+   int inplace;
+} Decoder;
+
+/* A varint that does not fit in an unsigned long, or is longer than
+ * put_varint() would have made it, is invalid. */
+static unsigned long
+get_varint(Decoder *d)
+{
+   unsigned long n = 0, bits;
+   int shift = 0;
+
+   do {
+      if (d->p >= d->end || shift >= (int) (sizeof(n) * CHAR_BIT))
+	 longjmp(d->abort, 1);
+      bits = *d->p & 0x7f;
+      if ((bits << shift) >> shift != bits ||
+	  (bits == 0 && shift > 0 && !(*d->p & 0x80)))
+	 longjmp(d->abort, 1);
+      n |= bits << shift;
+      shift += 7;
+   } while (*d->p++ & 0x80);
+   return n;
+}
+
+/* Check that one value is well formed and step over it, so that
+ * decode_value() never has to back out of a half-built tree. */
+static void
+skip_value(Decoder *d)
+{
+   unsigned long n, len;
+
+   if (d->p >= d->end)
+      longjmp(d->abort, 1);
+   switch (*d->p++) {
+    case VB_NIL:
+      break;
+    case VB_LIST:
+      n = get_varint(d);
+      while (n-- > 0)
+	 skip_value(d);
+      skip_value(d);
+      break;
+    case VB_STRING:
+    case VB_SYMBOL:
+      len = get_varint(d);
+      if (len >= (unsigned long) (d->end - d->p) || d->p[len] != '\0')
+	 longjmp(d->abort, 1);
+      d->p += len + 1;
+      break;
+    case VB_INTEGER:
+      get_varint(d);
+      break;
+    default:
+      longjmp(d->abort, 1);
+   }
+}
+
+static Value *
+decode_value(Decoder *d)
+{
+   Value *v, *list, **tail;
+   unsigned long n, len;
+   int tag;
+
+   switch (tag = *d->p++) {
+    case VB_LIST:
+      n = get_varint(d);
+      tail = &list;
+      while (n-- > 0) {
+	 *tail = ALLOC_VALUE();
+	 (*tail)->tag = cons;
+	 COUNT_NEW(*tail, 0);
+	 VCAR(*tail) = decode_value(d);
+	 tail = &VCDR(*tail);
+      }
+      *tail = decode_value(d);
+      return list;
+    case VB_STRING:
+    case VB_SYMBOL:
+      len = get_varint(d);
+      if (d->inplace) {
+	 v = ALLOC_VALUE();
+	 v->tag = (tag == VB_STRING) ? string : symbol;
+	 v->sflags = 0;
+	 v->value.s.length = len;
+	 v->value.s.string = (char *) d->p;
+	 COUNT_NEW(v, 0);
+      } else
+	 v = copy_string((tag == VB_STRING) ? string : symbol, len,
+			 (char *) d->p);
+      d->p += len + 1;
+      return v;
+    case VB_INTEGER:
+      n = get_varint(d);
+      return make_integer(UNZIGZAG(n));
+    case VB_NIL:
+    default:
+      return NULL;
+   }
+}
+
+/* Decode one framed value from buf, as parse() does for printed ones:
+ * returns the number of bytes consumed, or 0 if buf does not yet hold
+ * a whole frame or is not valid.  With inplace set, strings and symbols
+ * point into buf rather than being copied; such a tree must be freed
+ * with free_value_nodes(), and buf must outlive it. */
+int
+vdecode(int len, char *buf, Value **v, int inplace)
+{
+   Decoder d;
+   unsigned long body;
+   unsigned char *start;
+
+   *v = NULL;
+   d.p = (unsigned char *) buf;
+   d.end = d.p + len;
+   d.inplace = inplace;
+   if (len < 2 || *d.p++ != VBIN_MAGIC)
+      return 0;
+   if (setjmp(d.abort) != 0)
+      return 0;
+   body = get_varint(&d);
+   if (body > (unsigned long) (d.end - d.p))
+      return 0;
+   d.end = d.p + body;
+   start = d.p;
+   skip_value(&d);
+   if (d.p != d.end)
+      return 0;
+   d.p = start;
+   *v = decode_value(&d);
+   return (char *) d.end - buf;
+}
+
+/* Free a tree whose strings are not owned by it, as made by an
+ * in-place vdecode(). */
+void
+free_value_nodes(Value *v)
+{
+   Value *next;
+   int i;
+
+   while (VTAG(v) == cons) {
+      free_value_nodes(VCAR(v));
+      next = VCDR(v);
+      COUNT_FREE(v, 0);
+      free(v);
+      v = next;
+   }
+   if (VTAG(v) == vector) {
+      for (i = 0; i < VECLENGTH(v); i++)
+	 if (VECITEMS(v)[i] != VUNREAD)
+	    free_value_nodes(VECITEMS(v)[i]);
+      free_rest(v);
+   }
+   if (v != NULL && !VFIXNUMP(v)) {
+      COUNT_FREE(v, 0);
+      free(v);
+   }
+}
+
 #define CHECK_TAG(v, t) if (VTAG(v) != (t)) return 0
+#define IS_SEQ(v) (VTAG(v) == cons || VTAG(v) == vector)
+/* a var of tag cons takes vectors too */
+#define CHECK_VAR_TAG(p, v) \
+   if (VVTAG(p) != any && !(VVTAG(p) == cons && VTAG(v) == vector)) \
+      CHECK_TAG(v, VVTAG(p))
+
+int eqv(Value *v1, Value *v2);
+int destructure(Value *pattern, Value *match);
+
+/* a pattern that matches anything and binds nothing, so what it is
+ * matched against need not be read if it is lazy */
+#define IGNORES(p) (VTAG(p) == var && VVTAG(p) == any && VVDATA(p) == NULL)
+
+/* Compare two sequences, either of which may be a vector, element by
+ * element with same(), which is eqv() or destructure().  A vector is a
+ * proper list, so a cons sequence's tail must be nil -- except that a
+ * var takes the rest of a vector.  Bound, it gets the rest as a list
+ * that the vector owns. */
+static int
+match_seq(Value *p, Value *m, int (*same)(Value *, Value *))
+{
+   Value *rest;
+   int i = 0;
+
+   if (VTAG(p) == vector && VTAG(m) == vector) {
+      if (VECLENGTH(p) != VECLENGTH(m))
+	 return 0;
+      for (; i < VECLENGTH(p); i++)
+	 if (!IGNORES(VECREF(p, i)) && !same(VECREF(p, i), VECREF(m, i)))
+	    return 0;
+      return 1;
+   }
+   if (VTAG(p) == vector) {		/* and m a cons */
+      for (; i < VECLENGTH(p); i++, m = VCDR(m))
+	 if (VTAG(m) != cons || !same(VECREF(p, i), VCAR(m)))
+	    return 0;
+      return same(NULL, m);
+   }
+   for (; VTAG(p) == cons; i++, p = VCDR(p))	/* and m a vector */
+      if (i >= VECLENGTH(m) ||
+	  (!IGNORES(VCAR(p)) && !same(VCAR(p), VECREF(m, i))))
+	 return 0;
+   if (i == VECLENGTH(m))
+      return same(p, NULL);
+   if (VTAG(p) != var)
+      return 0;
+   if (same == eqv || VVDATA(p) == NULL)
+      return VVTAG(p) == any || VVTAG(p) == cons;
+   return (rest = vector_rest(m, i)) != NULL && same(p, rest);
+}
 
 int
 eqv(Value *v1, Value *v2)
 {
+   if (v1 == NULL)
+      return VTAG(v2) == nil;
+   if (IS_SEQ(v1) && IS_SEQ(v2) && (VTAG(v1) == vector || VTAG(v2) == vector))
+      return match_seq(v1, v2, eqv);
 
-   switch (v1->tag) {
+   switch (VTAG(v1)) {
 /*
     case any:
       return 1;
@@ -546,27 +1498,46 @@ eqv(Value *v1, Value *v2)
       return (VINTEGER(v1) == VINTEGER(v2));
       break;
     case var:
-      if (VVTAG(v1) != any)
-	 CHECK_TAG(v2, VVTAG(v1));
+      CHECK_VAR_TAG(v1, v2);
       return 1;
       break;
+    case vector:			/* and v2 is not a list */
+      return 0;
+      break;
     default:
-      fprintf(stderr,"eqv(): bad tag: %d\n",(int)(v1->tag));
+      fprintf(stderr,"eqv(): bad tag: %d\n",(int)VTAG(v1));
       /* die? */
       return 0;
       break;
    }
 }
 
+/* An item of a lazy vector that does not parse is not a pair, so a
+ * key in it is not found; vforce_failed() tells that from a key that
+ * is not there. */
 Value *
 assqv(Value *key, Value *assoc)
 {
    Value *pair;
+   int i;
+
+   if (VTAG(assoc) == vector) {
+      for (i = 0; i < VECLENGTH(assoc); i++) {
+	 if (VECITEMS(assoc)[i] == VUNREAD && !lazy_may_have_key(assoc, i, key))
+	    continue;
+	 pair = VECREF(assoc, i);
+	 if ((VTAG(pair) == cons && eqv(VCAR(pair), key)) ||
+	     (VTAG(pair) == vector && eqv(VECREF(pair, 0), key)))
+	    return pair;
+      }
+      return NULL;
+   }
 
    /* cdr on through */
    while (VTAG(assoc) == cons) {
       pair = VCAR(assoc);
-      if (VTAG(pair) == cons && eqv(VCAR(pair), key)) {
+      if ((VTAG(pair) == cons && eqv(VCAR(pair), key)) ||
+	  (VTAG(pair) == vector && eqv(VECREF(pair, 0), key))) {
 	 return pair;
       }
       assoc = VCDR(assoc);
@@ -574,9 +1545,16 @@ assqv(Value *key, Value *assoc)
    return NULL;
 }
 
+/* A lazy vector that an item failed to read from matches nothing,
+ * rather than matching with nil in that item's place. */
 int
 destructure(Value *pattern, Value *match)
 {
+   if (IS_SEQ(pattern) && IS_SEQ(match) &&
+       (VTAG(pattern) == vector || VTAG(match) == vector))
+      return (match_seq(pattern, match, destructure) &&
+	      !vforce_failed(match));
+
    switch (VTAG(pattern)) {
     case any:
       return 1;
@@ -604,9 +1582,11 @@ destructure(Value *pattern, Value *match)
       CHECK_TAG(match, integer);
       return (VINTEGER(pattern) == VINTEGER(match));
       break;
+    case vector:			/* and match is not a list */
+      return 0;
+      break;
     case var:
-      if (VVTAG(pattern) != any)
-	 CHECK_TAG(match, VVTAG(pattern));
+      CHECK_VAR_TAG(pattern, match);
       if (VVDATA(pattern) != NULL)
 	 *VVDATA(pattern) = (void *) match;
       return 1;
@@ -21,28 +21,86 @@
    ipc by passing printed s-expressions between emacs and the subprocess -
    strings are parsed into a union "Value" by this code and there is also a
    fairly convenient way to extract data.
-   
+
+   Lists are normally chains of conses.  vparse() with VPARSE_VECTORS
+   reads proper lists as vectors instead: one node holding an array of
+   the elements, so vlength() and vref() are O(1) and walking a list
+   does not chase a pointer per element.  eqv(), destructure(), assqv()
+   and prin() accept either form, and treat a vector like the proper
+   list with the same elements; a dotted pattern's last var is bound
+   to a list of the rest of a vector, which the vector owns and frees.
+
+   With VPARSE_LAZY, vparse() reads the outermost list only far enough
+   to find where its elements begin and end, stepping over them with a
+   quick scan for brackets and quotes, and returns a vector whose items
+   are each read in full the first time VECREF() or vref() asks for
+   them.  destructure() does not read the items that a pattern's
+   unbound any var matches, and assqv() checks the text of an unread
+   item for a symbol key before reading it, so a caller that parses a
+   message only to pick a few fields out of it never builds the rest.
+   The text must stay put until the tree is freed.  As the scan checks
+   only brackets and quotes, an element can turn out not to parse: it
+   reads as nil, vforce_failed() says so from then on, and
+   destructure() of the vector fails.
+
+   A node is a few bytes of tag and a union of two pointers: 12 bytes
+   with -m32, the default build, and 24 on LP64 hosts.  Nil is the NULL pointer and most integers are encoded
+   in the pointer itself, so neither is allocated, and short strings
+   and symbols are stored inside their node; see VFIXNUM and VS_SHORT
+   below.  VTAG(), VSDATA(), VSLENGTH() and VINTEGER() hide all this,
+   and must be used rather than the fields.
+
   */
 
 #include <stdlib.h>	/* for malloc() */
 
-enum Vtag { any, nil, cons, string, symbol, integer, var };
+enum Vtag { any, nil, cons, string, symbol, integer, var, vector };
+
+/* longest string kept inside its node: what fits in the union, less the
+ * NUL; 7 bytes with -m32, 15 on LP64 */
+#define VSHORT_MAX	((int) (2 * sizeof(void *)) - 1)
 
 typedef struct Value Value;
 struct Value {
-   enum Vtag tag;
+   unsigned char tag;		/* an enum Vtag */
+   unsigned char sflags;	/* tag string or symbol: VS_* */
+   unsigned char slength;	/* length of a VS_SHORT string */
    union {
       /* tag nil has no data */
       struct { Value *car, *cdr; } cons;
       struct { int length; char *string; } s;	/* tag string or symbol */
+      char chars[VSHORT_MAX + 1];		/* ... if VS_SHORT */
       struct { long i; } integer;
       struct { enum Vtag tag; void **value; } var;
+      struct { int length; Value **items; } vec;
    } value;
 };
 
+/* How a string or symbol holds its bytes.  Strings and symbols read
+ * or decoded by lread own a NUL-terminated copy, kept in the node if
+ * it is short enough and otherwise just after it, in the same block.
+ * Ones made with vmake_string() and friends point at their caller's
+ * bytes, which free_value() frees. */
+#define VS_SHORT	1	/* in value.chars */
+#define VS_TAIL		2	/* in the block, after the node */
+
 #define ALLOC_VALUE()	((Value *) malloc(sizeof(Value)))
+/* a vector and its items are one block; free() the node frees both.
+ * The slot after the items is for the vector's tail as a list, which
+ * destructure() builds for a dotted pattern. */
+#define ALLOC_VECTOR(n)	((Value *) malloc(sizeof(Value) + \
+					  ((n) + 1) * sizeof(Value *)))
+
+/* Integers that fit in a long less its top bit are not allocated at
+ * all: the Value pointer holds the integer, shifted left with the low
+ * bit set, which no node's address has.  Use VTAG() and VINTEGER(),
+ * never ->tag, on anything that might be one. */
+#define VFIXNUMP(v)	(((unsigned long) (v)) & 1)
+#define VFIXNUM(i)	((Value *) (((unsigned long) (i) << 1) | 1))
+#define VFIXNUM_FITS(i)	((long) ((unsigned long) (i) << 1) >> 1 == (i))
 
-#define VTAG(v) (v?((v)->tag):nil)
+#define VTAG(v) ((v) == NULL ? nil : VFIXNUMP(v) ? integer : \
+		 (enum Vtag) (v)->tag)
 
 extern Value *vmake_cons(Value *car, Value *cdr);
 #define VCAR(v) ((v)->value.cons.car)
@@ -53,19 +111,78 @@ extern Value *vmake_symbol_c(char *s);
 extern Value *vmake_string(int length, char *data);
 extern Value *vmake_string_c(char *s);
 extern char *vextract_string_c(Value *v);
-#define VSLENGTH(v) ((v)->value.s.length)
-#define VSDATA(v) ((v)->value.s.string)
+#define VSLENGTH(v) ((v)->sflags & VS_SHORT ? (v)->slength : \
+		     (v)->value.s.length)
+#define VSDATA(v) ((v)->sflags & VS_SHORT ? (v)->value.chars : \
+		   (v)->value.s.string)
 
 extern Value *vmake_integer(int n);
-#define VINTEGER(v) ((v)->value.integer.i)
+#define VINTEGER(v) (VFIXNUMP(v) ? (long) (v) >> 1 : (v)->value.integer.i)
 
 extern Value *vmake_var(enum Vtag tag, void **value);
 #define VVTAG(v) ((v)->value.var.tag)
 #define VVDATA(v) ((v)->value.var.value)
 
+extern Value *vmake_vector(int length, Value **items);
+#define VECLENGTH(v) ((v)->value.vec.length)
+#define VECITEMS(v) ((v)->value.vec.items)
+/* reads a lazy item if it has not been read yet */
+#define VECREF(v, i) (VECITEMS(v)[i] == VUNREAD ? vforce(v, i) : \
+		      VECITEMS(v)[i])
+
+/* what VECITEMS() holds for a lazy item not yet read */
+extern Value vunread;
+#define VUNREAD (&vunread)
+extern Value *vforce(Value *v, int i);
+extern int vforce_failed(Value *v);
+
 extern Value *assqv(Value *key, Value *assoc);
 extern int vlength(Value *l);
+extern Value *vref(Value *l, int i);
+
+/* flags for vparse() */
+#define VPARSE_VECTORS	1	/* proper lists become vectors */
+#define VPARSE_LAZY	2	/* a list's elements are read when used */
+extern int vparse(int slen, char *s, Value **v, int flags);
+
+/* binary encoding; see the comment above vencode() in lread.c */
+#define VBIN_MAGIC	0xB1
+extern int vencode(Value *v, char **bufp);
+extern int vdecode(int len, char *buf, Value **v, int inplace);
+extern void free_value_nodes(Value *v);
+
+/* With LREAD_STATS defined, lread counts the memory its trees hold:
+ * every node and the block it heads, and the caller's bytes that a
+ * vmake_string() tree will free.  Fixnums and nil are not allocated,
+ * and the parser's own scratch space is not counted.  Without it none
+ * of this exists and nothing is counted. */
+#ifdef LREAD_STATS
+#define VSTATS_BUCKETS	16
+
+typedef struct {
+   long nodes;			/* live */
+   long bytes;			/* live, in nodes and what they own */
+   long string_bytes;		/* ... of which string and symbol text */
+   long peak_bytes;		/* most bytes live at once */
+   long allocs;			/* nodes made */
+   long parses;			/* successful vparse() calls */
+   long parse_allocs;		/* nodes they made */
+   long extracts;		/* vextract_string_c() copies, which */
+   long extract_bytes;		/* ... their callers free */
+   /* strings and symbols made, by length: bucket b counts those of
+    * 2^(b-1) to 2^b - 1 bytes, bucket 0 the empty ones and the last
+    * bucket all the longer ones too */
+   long strings[VSTATS_BUCKETS];
+} VStats;
+
+/* Counters since the last vstats_reset(), or for ever; the live ones
+ * are never reset. */
+extern void vstats(VStats *s);
+extern void vstats_reset(void);
+#endif
 
 extern int eqv();
+extern int destructure();
 extern int parse();
 extern void free_value();
+extern void prin();
@@ -0,0 +1,684 @@
+/*
+   lread_bench.c  throughput benchmark for the elisp reader
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+   Runs parse, free_value, destructure, assqv and prin, and the binary
+   vencode and vdecode, over a handful of generated corpora and reports
+   ns/op, and MB/s and values/s of the input for the operations that go
+   over it ("-" for the others), allocations per parse, and the heap
+   bytes one parsed message occupies, counting malloc's own overhead.
+   parse, free_value, destructure and assqv are run again on trees read
+   with VPARSE_VECTORS; those lines have "_vec" appended.  "pick" is
+   what a typical caller does, parse a message, destructure and assqv
+   it and free it, and "pick_lazy" does the same with VPARSE_LAZY.
+   "stream" parses one message after another out of about 8MB of them,
+   newline separated, as zrecv writes them, and "bulk_jN" does the same
+   with vparse_bulk() on N threads, for each power of two up to -j (by
+   default, the number of CPUs).  Built with -DLREAD_STATS, it also
+   prints lread's own count of what one parse of each corpus holds, the
+   lengths of its strings, and whether any nodes are still live once
+   the corpus is done.  With -m the results are printed one per line,
+   tab separated, so they can be appended to a log and compared between
+   builds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "lread.h"
+#include "lbulk.h"
+
+#define DEFAULT_SECONDS 0.5
+#define STREAM_BYTES (8 * 1024 * 1024)
+
+typedef struct Corpus Corpus;
+struct Corpus {
+   const char	*name;
+   char		*text;		/* printed s-expression */
+   int		length;
+   Value	*pattern;	/* for destructure() */
+   Value	*key;		/* for assqv(), or NULL */
+};
+
+typedef struct {
+   char	*buf;
+   int	len;
+   int	size;
+} Buf;
+
+static void
+buf_add(Buf *b, const char *s, int n)
+{
+   if (b->len + n + 1 > b->size) {
+      while (b->len + n + 1 > b->size)
+	 b->size = b->size ? 2 * b->size : 4096;
+      b->buf = (char *) realloc(b->buf, b->size);
+   }
+   memcpy(b->buf + b->len, s, n);
+   b->len += n;
+   b->buf[b->len] = '\0';
+}
+
+static void
+buf_puts(Buf *b, const char *s)
+{
+   buf_add(b, s, strlen(s));
+}
+
+static double
+now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Number of Value nodes in v (nil does not count, it is not allocated). */
+static long
+count_values(Value *v)
+{
+   long n = 0;
+
+   while (VTAG(v) == cons) {
+      n += 1 + count_values(VCAR(v));
+      v = VCDR(v);
+   }
+   if (v != NULL)
+      n++;
+   return n;
+}
+
+/* Number of malloc() calls parse() made to build v: one per node,
+ * which holds its string or symbol body too, and none for integers,
+ * which are not allocated.  A vector is one node however long it is.
+ * The scratch buffer is only malloc'd for strings too long for the one
+ * on the stack, and is not counted. */
+static long
+count_allocs(Value *v)
+{
+   long n = 0;
+   int i;
+
+   while (VTAG(v) == cons) {
+      n += 1 + count_allocs(VCAR(v));
+      v = VCDR(v);
+   }
+   switch (VTAG(v)) {
+    case vector:			/* without reading lazy items */
+      n++;
+      for (i = 0; i < VECLENGTH(v); i++)
+	 if (VECITEMS(v)[i] != VUNREAD)
+	    n += count_allocs(VECITEMS(v)[i]);
+      break;
+    case integer:
+      n += !VFIXNUMP(v);
+      break;
+    case nil:
+      break;
+    default:
+      n++;
+      break;
+   }
+   return n;
+}
+
+/* Bytes of heap in use, as malloc counts them, or -1 if this libc
+ * cannot say. */
+static long
+heap_in_use(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+   struct mallinfo2 mi = mallinfo2();
+   return (long) (mi.uordblks + mi.hblkhd);
+#else
+   return -1;
+#endif
+}
+
+/* Corpora.  Each generator fills in the printed form of one message. */
+
+/* the kind of command emacs sends to tzc/zsend */
+static void
+gen_small(Corpus *c)
+{
+   static Value *klass;
+   Buf b = { NULL, 0, 0 };
+
+   buf_puts(&b, "((tzcfodder . send) (class . \"MESSAGE\") "
+	    "(instance . \"personal\") (opcode . \"\") "
+	    "(sender . \"daemon.zcommit\") (recipients \"gdb\" \"broder\") "
+	    "(port . 1234) (auth . t) "
+	    "(message \"daemon.zcommit\" \"Pushed 3 commits to master\"))");
+   c->name = "small";
+   c->text = b.buf;
+   c->length = b.len;
+   c->pattern = vmake_cons(vmake_var(cons, (void **) &klass),
+			   vmake_var(any, NULL));
+   c->key = vmake_symbol_c("message");
+}
+
+/* one long string with plenty of escapes, like a commit message body */
+static void
+gen_string(Corpus *c)
+{
+   static Value *body;
+   Buf b = { NULL, 0, 0 };
+   int i;
+
+   buf_puts(&b, "(message . \"");
+   for (i = 0; i < 2048; i++) {
+      buf_puts(&b, "  M src/zsend-0.0.1/lread.c\\n"
+	       "Said \\\"hello\\\" to the \\\\world\\\\\\t\\101\\102\\103 ");
+   }
+   buf_puts(&b, "\")");
+   c->name = "string";
+   c->text = b.buf;
+   c->length = b.len;
+   c->pattern = vmake_cons(vmake_symbol_c("message"),
+			   vmake_var(string, (void **) &body));
+   c->key = NULL;
+}
+
+/* deeply nested lists */
+#define NEST_DEPTH 2000
+
+static void
+gen_nested(Corpus *c)
+{
+   static Value *leaf;
+   Buf b = { NULL, 0, 0 };
+   Value *p;
+   int i;
+
+   for (i = 0; i < NEST_DEPTH; i++)
+      buf_puts(&b, "(a ");
+   buf_puts(&b, "42");
+   for (i = 0; i < NEST_DEPTH; i++)
+      buf_puts(&b, ")");
+   c->name = "nested";
+   c->text = b.buf;
+   c->length = b.len;
+
+   p = vmake_cons(vmake_symbol_c("a"),
+		  vmake_cons(vmake_var(integer, (void **) &leaf), NULL));
+   for (i = 1; i < NEST_DEPTH; i++)
+      p = vmake_cons(vmake_symbol_c("a"), vmake_cons(p, NULL));
+   c->pattern = p;
+   c->key = NULL;
+}
+
+/* a very long, flat association list */
+#define FLAT_LENGTH 10000
+
+static void
+gen_flat(Corpus *c)
+{
+   static Value *last;
+   Buf b = { NULL, 0, 0 };
+   char item[64];
+   int i;
+
+   buf_puts(&b, "(");
+   for (i = 0; i < FLAT_LENGTH; i++) {
+      sprintf(item, "(k%d . %d) ", i, i);
+      buf_puts(&b, item);
+   }
+   buf_puts(&b, ")");
+   c->name = "flat";
+   c->text = b.buf;
+   c->length = b.len;
+   c->pattern = vmake_cons(vmake_var(cons, (void **) &last),
+			   vmake_var(any, NULL));
+   sprintf(item, "k%d", FLAT_LENGTH - 1);
+   c->key = vmake_symbol_c(strdup(item));
+}
+
+/* Reporting */
+
+static int machine = 0;
+
+#ifdef LREAD_STATS
+/* lread's counts since the last vstats_reset(), with what was live
+ * then taken off, on '#' lines in machine-readable output */
+static void
+report_stats(Corpus *c, const char *what, VStats *base)
+{
+   VStats st;
+   int b, last;
+
+   vstats(&st);
+   printf("%s%-8s %-15s %ld nodes, %ld bytes live (%ld in strings), "
+	  "peak %ld, %ld allocs in %ld parses\n", machine ? "# " : "",
+	  c->name, what, st.nodes - base->nodes, st.bytes - base->bytes,
+	  st.string_bytes - base->string_bytes, st.peak_bytes - base->bytes,
+	  st.parse_allocs, st.parses);
+   for (last = VSTATS_BUCKETS - 1; last > 0 && st.strings[last] == 0; last--)
+      ;
+   if (st.strings[last] == 0)
+      return;
+   printf("%s%-8s %-15s", machine ? "# " : "", c->name, "string lengths");
+   for (b = 0; b <= last; b++)
+      if (st.strings[b] == 0)
+	 continue;
+      else if (b == 0)
+	 printf(" 0:%ld", st.strings[b]);
+      else if (b == VSTATS_BUCKETS - 1)
+	 printf(" >=%ld:%ld", 1L << (b - 1), st.strings[b]);
+      else
+	 printf(" <%ld:%ld", 1L << b, st.strings[b]);
+   putchar('\n');
+}
+#endif
+
+/* values < 0 for an operation that does not go over the input text,
+ * such as destructure or free_value, for which MB/s and values/s mean
+ * nothing and are printed as "-". */
+static void
+report(Corpus *c, const char *op, long iters, double secs,
+       long values, long allocs, long bytes)
+{
+   double per = secs / iters;
+   double mbps = (double) c->length / per / (1024.0 * 1024.0);
+   double vps = (double) values / per;
+
+   if (machine) {
+      printf("%s\t%s\t%ld\t%d\t", c->name, op, iters, c->length);
+      if (values >= 0)
+	 printf("%ld\t%.1f\t%.2f\t%.0f", values, per * 1e9, mbps, vps);
+      else
+	 printf("-\t%.1f\t-\t-", per * 1e9);
+      printf("\t%ld\t%ld\n", allocs, bytes);
+   }
+   else {
+      printf("%-8s %-15s %10.1f ns/op", c->name, op, per * 1e9);
+      if (values >= 0)
+	 printf(" %10.2f MB/s %14.0f values/s", mbps, vps);
+      else
+	 printf(" %10s MB/s %14s values/s", "-", "-");
+      if (allocs >= 0)
+	 printf(" %8ld allocs/parse", allocs);
+      if (bytes >= 0)
+	 printf(" %9ld bytes/parse", bytes);
+      putchar('\n');
+   }
+   fflush(stdout);
+}
+
+/* Operations are timed in batches so that reading the clock does not
+ * swamp the cheap ones (assqv on a small message is a few nanoseconds). */
+#define BATCH 64
+
+#define TIMED_LOOP(seconds, iters, secs, stmt)			\
+   do {								\
+      double t0_;						\
+      int k_;							\
+      (iters) = 0;						\
+      (secs) = 0;						\
+      while ((secs) < (seconds)) {				\
+	 t0_ = now();						\
+	 for (k_ = 0; k_ < BATCH; k_++)				\
+	    stmt;						\
+	 (secs) += now() - t0_;					\
+	 (iters) += BATCH;					\
+      }								\
+   } while (0)
+
+static int
+pick(Corpus *c, int flags, Value **vp)
+{
+   int ok;
+
+   vparse(c->length, c->text, vp, flags);
+   ok = destructure(c->pattern, *vp);
+   if (c->key != NULL)
+      ok &= (assqv(c->key, *vp) != NULL);
+   return ok;
+}
+
+/* Allocations and bytes are counted after the lookups, which is all
+ * that a lazy parse builds. */
+static void
+run_pick(Corpus *c, double seconds, const char *op, int flags, long values)
+{
+   Value *v;
+   long iters, allocs, bytes;
+   double secs;
+   int ok = 1;
+
+   bytes = heap_in_use();
+   ok &= pick(c, flags, &v);
+   if (bytes >= 0)
+      bytes = heap_in_use() - bytes;
+   allocs = count_allocs(v);
+   free_value(v);
+
+   TIMED_LOOP(seconds, iters, secs, (ok &= pick(c, flags, &v),
+				     free_value(v)));
+   if (!ok) {
+      fprintf(stderr, "lread_bench: corpus %s does not %s\n", c->name, op);
+      exit(1);
+   }
+   report(c, op, iters, secs, values, allocs, bytes);
+}
+
+/* Copies of the corpus, one per line, parsed as a stream: sequentially
+ * and then with vparse_bulk().  A stream is timed a whole one at a
+ * time, so it is reported as a corpus of its own size. */
+static void
+run_stream(Corpus *c, double seconds, long values, int nthreads)
+{
+   Corpus sc = *c;
+   Buf b = { NULL, 0, 0 };
+   Value *v, **vs;
+   long copies = 0, iters, n, k, consumed;
+   double secs, t0;
+   char op[32];
+   int len, j;
+
+   while (b.len < STREAM_BYTES) {
+      buf_add(&b, c->text, c->length);
+      buf_puts(&b, "\n");
+      copies++;
+   }
+   sc.text = b.buf;
+   sc.length = b.len;
+
+   /* the values are kept until the end, as vparse_bulk() keeps them */
+   iters = 0;
+   secs = 0;
+   while (secs < seconds) {
+      char *p = sc.text;
+      t0 = now();
+      vs = (Value **) malloc(copies * sizeof(Value *));
+      n = 0;
+      for (len = sc.length;
+	   n < copies && (k = vparse(len, p, &v, 0)) > 0 && v != NULL;
+	   p += k, len -= k)
+	 vs[n++] = v;
+      for (k = 0; k < n; k++)
+	 free_value(vs[k]);
+      free(vs);
+      secs += now() - t0;
+      iters++;
+      if (n != copies) {
+	 fprintf(stderr, "lread_bench: corpus %s does not stream\n",
+		 c->name);
+	 exit(1);
+      }
+   }
+   report(&sc, "stream", iters, secs, values * copies, -1, -1);
+
+   for (j = 1; j <= nthreads; j *= 2) {
+      iters = 0;
+      secs = 0;
+      while (secs < seconds) {
+	 t0 = now();
+	 n = vparse_bulk(sc.length, sc.text, 0, j, &vs, &consumed);
+	 for (k = 0; k < n; k++)
+	    free_value(vs[k]);
+	 free(vs);
+	 secs += now() - t0;
+	 iters++;
+	 if (n != copies) {
+	    fprintf(stderr, "lread_bench: corpus %s does not bulk parse\n",
+		    c->name);
+	    exit(1);
+	 }
+      }
+      sprintf(op, "bulk_j%d", j);
+      report(&sc, op, iters, secs, values * copies, -1, -1);
+   }
+   free(b.buf);
+}
+
+static void
+run_corpus(Corpus *c, double seconds, FILE *devnull, int nthreads)
+{
+   Value *v = NULL;
+   Value *batch[BATCH];
+   long iters, values, allocs, bytes;
+   double secs, psecs, fsecs;
+   char *bin, *enc;
+   int k, binlen, ok = 1;
+#ifdef LREAD_STATS
+   VStats base;
+#endif
+
+#ifdef LREAD_STATS
+   vstats_reset();
+   vstats(&base);
+#endif
+   bytes = heap_in_use();
+   if (parse(c->length, c->text, &v) != c->length || v == NULL) {
+      fprintf(stderr, "lread_bench: corpus %s does not parse\n", c->name);
+      exit(1);
+   }
+   if (bytes >= 0)
+      bytes = heap_in_use() - bytes;
+#ifdef LREAD_STATS
+   report_stats(c, "one parse", &base);
+#endif
+   values = count_values(v);
+   allocs = count_allocs(v);
+   free_value(v);
+
+   /* parse a batch, then free it, timing the two halves separately */
+   iters = 0;
+   psecs = fsecs = 0;
+   while (psecs < seconds) {
+      double t0 = now(), t1, t2;
+      for (k = 0; k < BATCH; k++)
+	 parse(c->length, c->text, &batch[k]);
+      t1 = now();
+      for (k = 0; k < BATCH; k++)
+	 free_value(batch[k]);
+      t2 = now();
+      psecs += t1 - t0;
+      fsecs += t2 - t1;
+      iters += BATCH;
+   }
+   report(c, "parse", iters, psecs, values, allocs, bytes);
+   report(c, "free_value", iters, fsecs, -1, -1, -1);
+
+   parse(c->length, c->text, &v);
+
+   TIMED_LOOP(seconds, iters, secs, ok &= destructure(c->pattern, v));
+   if (!ok) {
+      fprintf(stderr, "lread_bench: corpus %s does not destructure\n",
+	      c->name);
+      exit(1);
+   }
+   report(c, "destructure", iters, secs, -1, -1, -1);
+
+   if (c->key != NULL) {
+      TIMED_LOOP(seconds, iters, secs, ok &= (assqv(c->key, v) != NULL));
+      if (!ok) {
+	 fprintf(stderr, "lread_bench: corpus %s has no key\n", c->name);
+	 exit(1);
+      }
+      report(c, "assqv", iters, secs, -1, -1, -1);
+   }
+
+   TIMED_LOOP(seconds, iters, secs, prin(devnull, v));
+   report(c, "prin", iters, secs, values, -1, -1);
+
+   binlen = vencode(v, &bin);
+   /* check the decoded tree, not just the length, before timing it */
+   for (k = 0; k < 2; k++) {
+      Value *w;
+
+      ok &= (vdecode(binlen, bin, &w, k) == binlen && eqv(v, w));
+      if (k)
+	 free_value_nodes(w);
+      else
+	 free_value(w);
+   }
+   TIMED_LOOP(seconds, iters, secs, (vencode(v, &enc), free(enc)));
+   report(c, "vencode", iters, secs, values, -1, -1);
+
+   /* the binary timings are still reported against the printed size,
+    * so MB/s compares directly with parse */
+   iters = 0;
+   psecs = fsecs = 0;
+   while (psecs < seconds) {
+      double t0 = now(), t1;
+      for (k = 0; k < BATCH; k++)
+	 ok &= (vdecode(binlen, bin, &batch[k], 0) == binlen);
+      t1 = now();
+      for (k = 0; k < BATCH; k++)
+	 free_value(batch[k]);
+      psecs += t1 - t0;
+      iters += BATCH;
+   }
+   report(c, "vdecode", iters, psecs, values, -1, -1);
+
+   iters = 0;
+   psecs = 0;
+   while (psecs < seconds) {
+      double t0 = now(), t1;
+      for (k = 0; k < BATCH; k++)
+	 ok &= (vdecode(binlen, bin, &batch[k], 1) == binlen);
+      t1 = now();
+      for (k = 0; k < BATCH; k++)
+	 free_value_nodes(batch[k]);
+      psecs += t1 - t0;
+      iters += BATCH;
+   }
+   report(c, "vdecode_inplace", iters, psecs, values, -1, -1);
+   if (!ok) {
+      fprintf(stderr, "lread_bench: corpus %s does not round trip\n",
+	      c->name);
+      exit(1);
+   }
+   free(bin);
+
+   free_value(v);
+
+   bytes = heap_in_use();
+   vparse(c->length, c->text, &v, VPARSE_VECTORS);
+   if (bytes >= 0)
+      bytes = heap_in_use() - bytes;
+   allocs = count_allocs(v);
+   free_value(v);
+
+   iters = 0;
+   psecs = fsecs = 0;
+   while (psecs < seconds) {
+      double t0 = now(), t1, t2;
+      for (k = 0; k < BATCH; k++)
+	 vparse(c->length, c->text, &batch[k], VPARSE_VECTORS);
+      t1 = now();
+      for (k = 0; k < BATCH; k++)
+	 free_value(batch[k]);
+      t2 = now();
+      psecs += t1 - t0;
+      fsecs += t2 - t1;
+      iters += BATCH;
+   }
+   report(c, "parse_vec", iters, psecs, values, allocs, bytes);
+   report(c, "free_value_vec", iters, fsecs, -1, -1, -1);
+
+   vparse(c->length, c->text, &v, VPARSE_VECTORS);
+   TIMED_LOOP(seconds, iters, secs, ok &= destructure(c->pattern, v));
+   report(c, "destructure_vec", iters, secs, -1, -1, -1);
+   if (c->key != NULL) {
+      TIMED_LOOP(seconds, iters, secs, ok &= (assqv(c->key, v) != NULL));
+      report(c, "assqv_vec", iters, secs, -1, -1, -1);
+   }
+   if (!ok) {
+      fprintf(stderr, "lread_bench: corpus %s does not match as vectors\n",
+	      c->name);
+      exit(1);
+   }
+   free_value(v);
+
+   run_pick(c, seconds, "pick", 0, values);
+   run_pick(c, seconds, "pick_lazy", VPARSE_LAZY, values);
+   run_stream(c, seconds, values, nthreads);
+#ifdef LREAD_STATS
+   vstats_reset();
+   report_stats(c, "left over", &base);
+#endif
+}
+
+static void
+usage(const char *progname)
+{
+   fprintf(stderr, "usage: %s [options] [corpus ...]\n", progname);
+   fprintf(stderr, "   options:\n");
+   fprintf(stderr, "      -j <threads>   most threads for vparse_bulk\n");
+   fprintf(stderr, "      -m             machine-readable (tab separated) output\n");
+   fprintf(stderr, "      -t <seconds>   time to spend on each operation\n");
+   fprintf(stderr, "   corpora: small string nested flat (default: all)\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+   static void (*generators[])(Corpus *) = {
+      gen_small, gen_string, gen_nested, gen_flat
+   };
+   Corpus corpora[sizeof(generators) / sizeof(generators[0])];
+   int ncorpora = sizeof(generators) / sizeof(generators[0]);
+   double seconds = DEFAULT_SECONDS;
+   FILE *devnull;
+   int nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+   int i, j, sw;
+
+   while ((sw = getopt(argc, argv, "j:mt:")) != EOF)
+      switch (sw) {
+       case 'j':
+	 nthreads = atoi(optarg);
+	 break;
+       case 'm':
+	 machine = 1;
+	 break;
+       case 't':
+	 seconds = atof(optarg);
+	 break;
+       default:
+	 usage(argv[0]);
+	 exit(1);
+      }
+
+   if ((devnull = fopen("/dev/null", "w")) == NULL) {
+      perror("/dev/null");
+      exit(1);
+   }
+
+   for (i = 0; i < ncorpora; i++)
+      generators[i](&corpora[i]);
+
+   if (machine)
+      printf("#corpus\top\titerations\tbytes\tvalues\tns_per_op"
+	     "\tmb_per_s\tvalues_per_s\tallocs_per_parse\tbytes_per_parse\n");
+
+   for (i = 0; i < ncorpora; i++) {
+      int selected = (optind == argc);
+      for (j = optind; j < argc; j++)
+	 if (!strcmp(argv[j], corpora[i].name))
+	    selected = 1;
+      if (selected)
+	 run_corpus(&corpora[i], seconds, devnull, nthreads);
+   }
+   return 0;
+}
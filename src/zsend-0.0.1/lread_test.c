@@ -0,0 +1,242 @@
+/*
+   lread_test.c  tests for lread's binary encoding and lazy vectors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+   Each sample is parsed, as lists and as vectors, encoded with
+   vencode(), and decoded again both copying and in place, and the
+   result compared with eqv().  Then every truncation of each frame must be refused, and every one-byte
+   corruption must either be refused or decode to a tree that can be
+   walked and freed; zsendd feeds socket and spool bytes to vdecode(),
+   so neither may crash it.  A lazy item that does not parse must be
+   reported, not read as nil, and a dotted pattern must bind the rest
+   of a vector.  Run by "make check" (best under ASan);
+   prints what failed, and exits non-zero if anything did.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lread.h"
+
+static int failures;
+
+#define CHECK(cond, what) \
+   do { if (!(cond)) { \
+      fprintf(stderr, "%s:%d: %s: failed: %s\n", __FILE__, __LINE__, \
+	      (what), #cond); \
+      failures++; \
+   } } while (0)
+
+static char *samples[] = {
+   "nil",
+   "0",
+   "-1",
+   "1073741823",
+   "-1073741824",
+   "\"\"",
+   "\"short\"",
+   "\"a string long enough not to fit inside its node\"",
+   "sym",
+   "(a . b)",
+   "(1 2 3)",
+   "(a (b (c (d))) \"e\" . 5)",
+   "((class . \"zcommit\") (instance . \"1a2b3c4d\") (opcode . \"\")"
+   " (sender . \"daemon.zcommit\") (recipients \"gdb\" \"broder\")"
+   " (message . \"line one\\nline \\\"two\\\"\\n\"))",
+};
+
+static void
+round_trip(char *text, int flags)
+{
+   Value *v, *w;
+   char *bin, *copy;
+   int len, n, inplace, i, cut;
+
+   /* an atom is read up to the character after it: here, the '\0' */
+   if (vparse(strlen(text) + 1, text, &v, flags) <= 0) {
+      CHECK(0, text);
+      return;
+   }
+   len = vencode(v, &bin);
+   CHECK(len > 0, text);
+   if (len <= 0) {
+      free_value(v);
+      return;
+   }
+
+   for (inplace = 0; inplace < 2; inplace++) {
+      copy = (char *) malloc(len);
+      memcpy(copy, bin, len);
+      n = vdecode(len, copy, &w, inplace);
+      CHECK(n == len, text);
+      CHECK(n == len && eqv(v, w) && eqv(w, v), text);
+      if (inplace)
+	 free_value_nodes(w);
+      else
+	 free_value(w);
+
+      /* every frame cut short is refused */
+      for (cut = 0; cut < len; cut++) {
+	 n = vdecode(cut, copy, &w, inplace);
+	 CHECK(n == 0 && w == NULL, text);
+      }
+
+      /* a corrupt byte is refused, or makes some other tree */
+      for (i = 0; i < len; i++) {
+	 memcpy(copy, bin, len);
+	 copy[i] ^= 0x5a;
+	 if ((n = vdecode(len, copy, &w, inplace)) > 0) {
+	    CHECK(n <= len, text);
+	    (void) eqv(v, w);
+	    if (inplace)
+	       free_value_nodes(w);
+	    else
+	       free_value(w);
+	 }
+      }
+      free(copy);
+   }
+   free(bin);
+   free_value(v);
+}
+
+/* Varints too long for an unsigned long, or longer than they need be,
+ * are refused. */
+static void
+bad_varints(void)
+{
+   /* (5), then the same with the body length and then the integer
+    * padded out with a zero byte */
+   char ok[] = { (char) VBIN_MAGIC, 2, 4, 10 };
+   char long_len[] = { (char) VBIN_MAGIC, (char) 0x82, 0, 4, 10 };
+   char long_int[] = { (char) VBIN_MAGIC, 3, 4, (char) 0x8a, 0 };
+   char huge[16];
+   Value *w;
+   int i;
+
+   CHECK(vdecode(sizeof(ok), ok, &w, 0) == sizeof(ok) &&
+	 VINTEGER(w) == 5, "varint");
+   free_value(w);
+   CHECK(vdecode(sizeof(long_len), long_len, &w, 0) == 0, "overlong");
+   CHECK(vdecode(sizeof(long_int), long_int, &w, 0) == 0, "overlong");
+
+   /* an integer of more bits than an unsigned long holds */
+   huge[0] = (char) VBIN_MAGIC;
+   huge[1] = 13;
+   huge[2] = 4;
+   for (i = 3; i < 14; i++)
+      huge[i] = (char) 0xff;
+   huge[14] = 0x7f;
+   CHECK(vdecode(15, huge, &w, 0) == 0, "too wide");
+}
+
+/* A lazy item that does not parse reads as nil, but is not taken for
+ * one. */
+static void
+lazy_bad_item(void)
+{
+   static char text[] = "((a . 1) (b . c d) (c . 3))";
+   static void *x, *y;
+   Value *v, *b, *c, *pattern;
+
+   b = vmake_symbol_c("b");
+   c = vmake_symbol_c("c");
+   CHECK(vparse(sizeof(text), text, &v, VPARSE_LAZY) > 0, "lazy");
+   CHECK(!vforce_failed(v), "lazy");
+   CHECK(assqv(c, v) != NULL, "lazy");
+   CHECK(!vforce_failed(v), "lazy");
+   CHECK(assqv(b, v) == NULL, "lazy");
+   CHECK(vforce_failed(v), "lazy");
+
+   pattern = vmake_cons(vmake_var(any, &x),
+			vmake_cons(vmake_var(any, &y),
+				   vmake_cons(vmake_var(any, NULL), NULL)));
+   CHECK(!destructure(pattern, v), "lazy");
+   free_value_nodes(pattern);
+   free_value_nodes(b);
+   free_value_nodes(c);
+   free_value(v);
+}
+
+/* A dotted pattern binds the rest of a vector as a list. */
+static void
+vector_rest(void)
+{
+   static char text[] = "(key 1 2 3)";
+   static char tail[] = "(2 3)";
+   static int flags[] = { VPARSE_VECTORS, VPARSE_LAZY,
+			  VPARSE_LAZY | VPARSE_VECTORS };
+   Value *rest, *rest2, *v, *w, *p1, *p2;
+   unsigned f;
+
+   p1 = vmake_cons(vmake_symbol_c("key"), vmake_var(any, (void **) &rest));
+   p2 = vmake_cons(vmake_symbol_c("key"),
+		   vmake_cons(vmake_integer(1),
+			      vmake_var(cons, (void **) &rest2)));
+   vparse(sizeof(tail), tail, &w, 0);
+   for (f = 0; f < sizeof(flags) / sizeof(flags[0]); f++) {
+      CHECK(vparse(sizeof(text), text, &v, flags[f]) > 0, "rest");
+      rest = rest2 = NULL;
+      CHECK(destructure(p1, v) && vlength(rest) == 3, "rest");
+      CHECK(VTAG(rest) == cons && VINTEGER(VCAR(rest)) == 1, "rest");
+      CHECK(destructure(p2, v) && eqv(rest2, w), "rest");
+      CHECK(VCDR(rest) == rest2, "rest");
+      free_value(v);
+   }
+   free_value(w);
+   free_value_nodes(p1);
+   free_value_nodes(p2);
+}
+
+/* A var cannot be encoded, however deep it is. */
+static void
+unencodable(void)
+{
+   static void *x;
+   Value *v;
+   char *bin;
+
+   v = vmake_cons(vmake_symbol_c("a"),
+		  vmake_cons(vmake_var(string, &x), NULL));
+   CHECK(vencode(v, &bin) == -1 && bin == NULL, "var in a list");
+   free_value_nodes(v);
+   v = vmake_cons(vmake_symbol_c("a"), vmake_var(string, &x));
+   CHECK(vencode(v, &bin) == -1 && bin == NULL, "var as a tail");
+   free_value_nodes(v);
+}
+
+int
+main(void)
+{
+   unsigned i;
+
+   for (i = 0; i < sizeof(samples) / sizeof(samples[0]); i++)
+      round_trip(samples[i], 0);
+   for (i = 0; i < sizeof(samples) / sizeof(samples[0]); i++)
+      round_trip(samples[i], VPARSE_VECTORS);
+   bad_varints();
+   unencodable();
+   lazy_bad_item();
+   vector_rest();
+
+   if (failures > 0) {
+      fprintf(stderr, "lread_test: %d failed\n", failures);
+      return 1;
+   }
+   printf("lread_test: ok\n");
+   return 0;
+}
@@ -0,0 +1,480 @@
+/*
+   pool.c  pre-forked sender workers fed through shared-memory rings
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+
+#include "pool.h"
+
+/* Bytes of records per ring; a power of two, so positions can run on
+ * past it and wrap around unsigned arithmetic. */
+#define RING_BYTES	(4 * 1024 * 1024)
+/* Records outstanding per worker, and completion slots to match. */
+#define RING_SLOTS	1024
+#define MAX_RECIPIENT	256
+#define WRAP		0xffffffffu	/* record length: skip to the start */
+/* Records a worker may have waiting for room in its ring.  zsendd
+ * keeps no more than -f in flight, so this is only reached if a worker
+ * stops taking records; it bounds what is held for it meanwhile. */
+#define MAX_OVERFLOW	RING_SLOTS
+/* A worker that dies sooner than this after starting is restarted
+ * only after this long, so a broken one is not forked in a loop. */
+#define RESTART_MS	1000
+
+#define CACHE_LINE	64
+
+#define LOAD(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+typedef struct {
+   unsigned	len;		/* of the data, or WRAP */
+   unsigned	tag;
+   unsigned	done;		/* completed; a restarted worker skips it */
+   unsigned	pad;
+} RecordHeader;
+
+typedef struct {
+   unsigned	tag;
+   Code_t	code;
+   char		recipient[MAX_RECIPIENT];
+} Completion;
+
+/* Shared between the supervisor and one worker.  Each index is written
+ * by one side only, and each lives on its own cache line. */
+typedef struct {
+   unsigned	head;		/* supervisor: end of the last record */
+   char		pad0[CACHE_LINE - sizeof(unsigned)];
+   unsigned	next;		/* worker: next record to read */
+   char		pad1[CACHE_LINE - sizeof(unsigned)];
+   unsigned	comp_head;	/* worker: completions written */
+   char		pad2[CACHE_LINE - sizeof(unsigned)];
+   unsigned	comp_tail;	/* supervisor: completions read */
+   char		pad3[CACHE_LINE - sizeof(unsigned)];
+   Completion	comp[RING_SLOTS];
+   char		data[RING_BYTES];
+} Ring;
+
+/* A record the supervisor is waiting to hear about. */
+typedef struct {
+   unsigned	pos;		/* of its header */
+   unsigned	end;		/* where the next record goes */
+   int		completed;
+   ZSendDone	done;
+   void		*arg;
+} Outstanding;
+
+/* A record that did not fit in the ring yet. */
+typedef struct Overflow Overflow;
+struct Overflow {
+   char		*data;
+   int		len;
+   ZSendDone	done;
+   void		*arg;
+   Overflow	*next;
+};
+
+struct PoolWorker {
+   Pool		*pool;
+   int		index;
+   pid_t	pid;		/* 0 while not running */
+   long long	started;
+   Ring		*ring;
+   int		req_efd;	/* supervisor -> worker */
+   int		comp_efd;	/* worker -> supervisor */
+   EvTimer	*restart_timer;
+
+   /* supervisor's bookkeeping; tags count up from 0 */
+   unsigned	tail;		/* start of the oldest outstanding record */
+   unsigned	tag_head, tag_tail;
+   Outstanding	out[RING_SLOTS];
+   Overflow	*overflow, **overflow_tail;
+   int		noverflow;
+};
+
+struct Pool {
+   EvLoop	*loop;
+   PoolMain	main;
+   int		n;
+   PoolWorker	*workers;
+   int		stopping;
+};
+
+static unsigned
+record_size(int len)
+{
+   return sizeof(RecordHeader) + ((len + 15) & ~15);
+}
+
+/* Supervisor side. */
+
+static void
+notify(int efd)
+{
+   unsigned long long one = 1;
+
+   (void) write(efd, &one, sizeof(one));
+}
+
+static void
+clear(int efd)
+{
+   unsigned long long n;
+
+   (void) read(efd, &n, sizeof(n));
+}
+
+/* Copy a record into the ring if it fits.  Returns 0 if it does not. */
+static int
+push(PoolWorker *w, const char *data, int len, ZSendDone done, void *arg)
+{
+   Ring *r = w->ring;
+   unsigned head = r->head;
+   unsigned size = record_size(len);
+   unsigned off = head % RING_BYTES;
+   unsigned gap = 0;
+   RecordHeader *h;
+   Outstanding *o;
+
+   if (w->tag_head - w->tag_tail >= RING_SLOTS)
+      return 0;
+   if (off + size > RING_BYTES)
+      gap = RING_BYTES - off;	/* always a multiple of 16 */
+   if ((head + gap + size) - w->tail > RING_BYTES)
+      return 0;
+
+   if (gap) {
+      ((RecordHeader *) (r->data + off))->len = WRAP;
+      head += gap;
+      off = 0;
+   }
+   h = (RecordHeader *) (r->data + off);
+   h->len = len;
+   h->tag = w->tag_head;
+   h->done = 0;
+   memcpy(h + 1, data, len);
+
+   o = &w->out[w->tag_head % RING_SLOTS];
+   o->pos = head;
+   o->end = head + size;
+   o->completed = 0;
+   o->done = done;
+   o->arg = arg;
+   w->tag_head++;
+
+   STORE(&r->head, head + size);
+   notify(w->req_efd);
+   return 1;
+}
+
+static void
+flush_overflow(PoolWorker *w)
+{
+   Overflow *o;
+
+   while ((o = w->overflow) != NULL &&
+	  push(w, o->data, o->len, o->done, o->arg)) {
+      if ((w->overflow = o->next) == NULL)
+	 w->overflow_tail = &w->overflow;
+      w->noverflow--;
+      free(o->data);
+      free(o);
+   }
+}
+
+/* Hand data to worker shard % size.  It is copied; done gets the
+ * outcome once the worker has it.  Returns -1 with errno ENOMEM, or
+ * EAGAIN if too many records are waiting for that worker already, and
+ * then done is not called. */
+int
+pool_submit(Pool *p, unsigned shard, const char *data, int len,
+	    ZSendDone done, void *arg)
+{
+   PoolWorker *w = &p->workers[shard % p->n];
+   Overflow *o;
+
+   if (w->overflow == NULL && push(w, data, len, done, arg))
+      return 0;
+   if (w->noverflow >= MAX_OVERFLOW) {
+      errno = EAGAIN;
+      return -1;
+   }
+   if ((o = (Overflow *) malloc(sizeof(Overflow))) == NULL)
+      return -1;
+   if ((o->data = (char *) malloc(len)) == NULL) {
+      free(o);
+      return -1;
+   }
+   memcpy(o->data, data, len);
+   o->len = len;
+   o->done = done;
+   o->arg = arg;
+   o->next = NULL;
+   *w->overflow_tail = o;
+   w->overflow_tail = &o->next;
+   w->noverflow++;
+   return 0;
+}
+
+/* Read every completion the worker has written. */
+static void
+reap_completions(PoolWorker *w)
+{
+   Ring *r = w->ring;
+   unsigned head = LOAD(&r->comp_head);
+   Completion *c;
+   Outstanding *o;
+   unsigned tag;
+   Code_t code;
+   char recipient[MAX_RECIPIENT];
+
+   while (r->comp_tail != head) {
+      /* copy it out before giving the slot back */
+      c = &r->comp[r->comp_tail % RING_SLOTS];
+      tag = c->tag;
+      code = c->code;
+      strcpy(recipient, c->recipient);
+      STORE(&r->comp_tail, r->comp_tail + 1);
+      o = &w->out[tag % RING_SLOTS];
+      if (tag - w->tag_tail >= w->tag_head - w->tag_tail || o->completed)
+	 continue;		/* not ours, or already heard about */
+      o->completed = 1;
+      STORE(&((RecordHeader *) (r->data + o->pos % RING_BYTES))->done, 1);
+      o->done(NULL, code, recipient, o->arg);
+   }
+   /* the ring space goes back in order */
+   while (w->tag_tail != w->tag_head &&
+	  (o = &w->out[w->tag_tail % RING_SLOTS])->completed) {
+      w->tail = o->end;
+      w->tag_tail++;
+   }
+   flush_overflow(w);
+}
+
+static void
+comp_ready(EvLoop *loop, int fd, unsigned events, void *arg)
+{
+   PoolWorker *w = (PoolWorker *) arg;
+
+   clear(fd);
+   reap_completions(w);
+}
+
+static void
+close_other_fds(PoolWorker *w)
+{
+   long fd, max = sysconf(_SC_OPEN_MAX);
+
+   for (fd = 3; fd < max; fd++)
+      if (fd != w->req_efd && fd != w->comp_efd)
+	 (void) close(fd);
+}
+
+static int
+spawn(PoolWorker *w)
+{
+   sigset_t none;
+   pid_t pid;
+
+   if ((pid = fork()) < 0)
+      return -1;
+   if (pid > 0) {
+      w->pid = pid;
+      w->started = ev_now_ms();
+      return 0;
+   }
+
+   /* the worker: nothing of the supervisor's but its own ring, so that
+      client sockets close when the supervisor closes them */
+   prctl(PR_SET_PDEATHSIG, SIGTERM);
+   close_other_fds(w);
+   sigemptyset(&none);
+   sigprocmask(SIG_SETMASK, &none, NULL);
+   w->pool->main(w);
+   _exit(0);
+}
+
+static void
+restart(EvLoop *loop, EvTimer *t, void *arg)
+{
+   PoolWorker *w = (PoolWorker *) arg;
+
+   if (w->pool->stopping || w->pid != 0)
+      return;
+   if (spawn(w) < 0) {
+      perror("fork");
+      ev_timer_set(w->restart_timer, RESTART_MS);
+   }
+}
+
+static void
+child_exited(EvLoop *loop, int signo, void *arg)
+{
+   Pool *p = (Pool *) arg;
+   PoolWorker *w;
+   pid_t pid;
+   int i, status;
+
+   while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      for (i = 0, w = NULL; i < p->n; i++)
+	 if (p->workers[i].pid == pid)
+	    w = &p->workers[i];
+      if (w == NULL)
+	 continue;
+      w->pid = 0;
+      if (p->stopping)
+	 continue;
+      fprintf(stderr, "worker %d (pid %d) %s %d; restarting\n", w->index,
+	      (int) pid, WIFSIGNALED(status) ? "killed by signal" : "exited",
+	      WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status));
+
+      /* take what it finished, then start over at what it did not */
+      reap_completions(w);
+      w->ring->next = w->tail;
+      ev_timer_set(w->restart_timer,
+		   ev_now_ms() - w->started < RESTART_MS ? RESTART_MS : 0);
+   }
+}
+
+/* Fork nworkers workers, each running main.  Returns NULL with errno
+ * set on failure. */
+Pool *
+pool_start(EvLoop *loop, int nworkers, PoolMain main)
+{
+   Pool *p = (Pool *) calloc(1, sizeof(Pool));
+   PoolWorker *w;
+   int i;
+
+   p->loop = loop;
+   p->main = main;
+   p->n = nworkers;
+   p->workers = (PoolWorker *) calloc(nworkers, sizeof(PoolWorker));
+   if (ev_signal(loop, SIGCHLD, child_exited, p) < 0)
+      return NULL;
+
+   /* every ring must exist before any worker is forked */
+   for (i = 0; i < nworkers; i++) {
+      w = &p->workers[i];
+      w->pool = p;
+      w->index = i;
+      w->overflow_tail = &w->overflow;
+      w->ring = (Ring *) mmap(NULL, sizeof(Ring), PROT_READ | PROT_WRITE,
+			      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+      if (w->ring == (Ring *) MAP_FAILED)
+	 return NULL;
+      if ((w->req_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+	  (w->comp_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+	 return NULL;
+      if ((w->restart_timer = ev_timer(loop, restart, w)) == NULL ||
+	  ev_add(loop, w->comp_efd, EPOLLIN, comp_ready, w) < 0)
+	 return NULL;
+   }
+   for (i = 0; i < nworkers; i++)
+      if (spawn(&p->workers[i]) < 0)
+	 return NULL;
+   return p;
+}
+
+int
+pool_size(Pool *p)
+{
+   return p->n;
+}
+
+/* Stop every worker and wait for it.  Records not yet completed are
+ * abandoned; their done callbacks are not called. */
+void
+pool_stop(Pool *p)
+{
+   int i;
+
+   p->stopping = 1;
+   for (i = 0; i < p->n; i++)
+      if (p->workers[i].pid != 0)
+	 kill(p->workers[i].pid, SIGTERM);
+   for (i = 0; i < p->n; i++)
+      if (p->workers[i].pid != 0)
+	 (void) waitpid(p->workers[i].pid, NULL, 0);
+}
+
+/* Worker side. */
+
+/* Becomes readable when there may be records to read. */
+int
+pool_worker_fd(PoolWorker *w)
+{
+   return w->req_efd;
+}
+
+/* Take the next record, if there is one.  data points into the ring
+ * and is good until the record is completed. */
+int
+pool_worker_next(PoolWorker *w, char **data, int *len, unsigned *tag)
+{
+   Ring *r = w->ring;
+   RecordHeader *h;
+   int cleared = 0;
+
+   for (;;) {
+      if (r->next == LOAD(&r->head)) {
+	 if (cleared)
+	    return 0;
+	 /* look once more after clearing, or a record pushed in between
+	    would wait for the next one */
+	 clear(w->req_efd);
+	 cleared = 1;
+	 continue;
+      }
+      h = (RecordHeader *) (r->data + r->next % RING_BYTES);
+      if (h->len == WRAP) {
+	 STORE(&r->next, r->next + (RING_BYTES - r->next % RING_BYTES));
+	 continue;
+      }
+      STORE(&r->next, r->next + record_size(h->len));
+      if (LOAD(&h->done))
+	 continue;		/* finished before we were restarted */
+      *data = (char *) (h + 1);
+      *len = h->len;
+      *tag = h->tag;
+      return 1;
+   }
+}
+
+void
+pool_worker_done(PoolWorker *w, unsigned tag, Code_t code,
+		 const char *recipient)
+{
+   Ring *r = w->ring;
+   Completion *c = &r->comp[r->comp_head % RING_SLOTS];
+
+   c->tag = tag;
+   c->code = code;
+   strncpy(c->recipient, recipient ? recipient : "", MAX_RECIPIENT - 1);
+   c->recipient[MAX_RECIPIENT - 1] = '\0';
+   STORE(&r->comp_head, r->comp_head + 1);
+   notify(w->comp_efd);
+}
@@ -0,0 +1,66 @@
+/*
+   pool.h  pre-forked sender workers fed through shared-memory rings
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+   libzephyr keeps its port in global state, so a process can only
+   send through one port on one core.  A Pool forks workers, each of
+   which opens its own port, and gives each one a ring in memory
+   shared with the supervisor:
+
+      supervisor --- records --->  worker
+                 <- completions -
+
+   Both directions are single-producer, single-consumer, so neither
+   side takes a lock; an eventfd in each direction wakes the other
+   side's event loop.  The supervisor picks the worker (the shard) for
+   each record, and a worker handles its records in order, so records
+   given the same shard are sent in the order they were submitted.
+
+   A record stays in the ring until its completion has been read.  If
+   a worker dies, the supervisor starts a new one on the same ring,
+   which begins again at the oldest record not yet completed; a notice
+   whose completion was lost with the old worker is sent again.
+  */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include "evloop.h"
+#include "zsend.h"
+
+typedef struct Pool Pool;
+typedef struct PoolWorker PoolWorker;
+
+/* Runs in each forked worker; it should serve the ring until told to
+ * stop and then return. */
+typedef void (*PoolMain)(PoolWorker *w);
+
+/* Supervisor side.  done is called from the supervisor's loop with a
+ * NULL session. */
+extern Pool *pool_start(EvLoop *loop, int nworkers, PoolMain main);
+extern int pool_size(Pool *p);
+extern int pool_submit(Pool *p, unsigned shard, const char *data, int len,
+		       ZSendDone done, void *arg);
+extern void pool_stop(Pool *p);
+
+/* Worker side. */
+extern int pool_worker_fd(PoolWorker *w);
+extern int pool_worker_next(PoolWorker *w, char **data, int *len,
+			    unsigned *tag);
+extern void pool_worker_done(PoolWorker *w, unsigned tag, Code_t code,
+			     const char *recipient);
+
+#endif /* POOL_H */
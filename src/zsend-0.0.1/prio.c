@@ -0,0 +1,286 @@
+/*
+   prio.c  multi-level priority queue with starvation protection
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "prio.h"
+
+/* Waits are counted in power-of-two buckets of microseconds, which is
+ * enough to give the 99th percentile to within a factor of two. */
+#define NBUCKETS	32
+
+typedef struct Node Node;
+struct Node {
+   void		*item;
+   long long	queued;		/* usec */
+   Node		*next;
+};
+
+typedef struct Lane Lane;
+struct Lane {
+   Node		*head, *tail;
+   int		length;
+
+   /* since the last report */
+   long		count;
+   double	total_us;
+   long long	max_us;
+   long		buckets[NBUCKETS];
+};
+
+struct PrioQueue {
+   Lane		*lanes;
+   int		nlanes;
+   int		starve_ratio;
+   int		run;		/* taken while a lower lane waited */
+   int		length;
+   Node		*free_nodes;
+};
+
+/* in 64 bits, as a 32-bit long of microseconds wraps in 36 minutes */
+static long long
+now_us(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+PrioQueue *
+pq_new(int nlanes, int starve_ratio)
+{
+   PrioQueue *q = (PrioQueue *) calloc(1, sizeof(PrioQueue));
+
+   if (q == NULL)
+      return NULL;
+   if ((q->lanes = (Lane *) calloc(nlanes, sizeof(Lane))) == NULL) {
+      free(q);
+      return NULL;
+   }
+   q->nlanes = nlanes;
+   q->starve_ratio = starve_ratio < 1 ? 1 : starve_ratio;
+   return q;
+}
+
+static Node *
+new_node(PrioQueue *q, void *item, long long queued)
+{
+   Node *n = q->free_nodes;
+
+   if (n != NULL)
+      q->free_nodes = n->next;
+   else if ((n = (Node *) malloc(sizeof(Node))) == NULL)
+      return NULL;
+   n->item = item;
+   n->queued = queued;
+   n->next = NULL;
+   return n;
+}
+
+/* Returns 0, or -1 if there is no memory to queue item. */
+int
+pq_push(PrioQueue *q, int lane, void *item)
+{
+   Lane *l = &q->lanes[lane];
+   Node *n;
+
+   if ((n = new_node(q, item, now_us())) == NULL)
+      return -1;
+   if (l->tail != NULL)
+      l->tail->next = n;
+   else
+      l->head = n;
+   l->tail = n;
+   l->length++;
+   q->length++;
+   return 0;
+}
+
+/* For an item taken off the queue that has to go back, e.g. because
+ * sending it failed: it goes ahead of everything else in the lane it
+ * came from, and counts as queued since it was first queued.  stamp is
+ * what pq_pop() gave for it.  Returns 0, or -1 if there is no memory to
+ * queue it, in which case it has left the queue for good and its wait
+ * is counted. */
+int
+pq_push_front(PrioQueue *q, void *item, const PqStamp *stamp)
+{
+   Lane *l = &q->lanes[stamp->lane];
+   Node *n;
+
+   if ((n = new_node(q, item, stamp->queued)) == NULL) {
+      pq_done(q, stamp);
+      return -1;
+   }
+      return -1;
+   n->next = l->head;
+   l->head = n;
+   if (l->tail == NULL)
+      l->tail = n;
+   l->length++;
+   q->length++;
+   return 0;
+}
+
+static void
+count_wait(Lane *l, long long us)
+{
+   int b = 0;
+
+   l->count++;
+   l->total_us += us;
+   if (us > l->max_us)
+      l->max_us = us;
+   while (b < NBUCKETS - 1 && us >= (1LL << b))
+      b++;
+   l->buckets[b]++;
+}
+
+/* The most urgent non-empty lane, or the longest-waiting lane below it
+ * if that one has had its turn. */
+static int
+choose_lane(PrioQueue *q)
+{
+   int top, i, pick = -1;
+
+   for (top = 0; top < q->nlanes; top++)
+      if (q->lanes[top].head != NULL)
+	 break;
+   if (top == q->nlanes)
+      return -1;
+
+   for (i = top + 1; i < q->nlanes; i++)
+      if (q->lanes[i].head != NULL &&
+	  (pick < 0 || q->lanes[i].head->queued < q->lanes[pick].head->queued))
+	 pick = i;
+   if (pick < 0) {
+      q->run = 0;		/* nobody else is waiting */
+      return top;
+   }
+   if (++q->run > q->starve_ratio) {
+      q->run = 0;
+      return pick;
+   }
+   return top;
+}
+
+/* Take the next item, or return NULL if the queue is empty.  *stamp
+ * is set to where the item was and how long it waited, for pq_done()
+ * once the item has left for good, or pq_push_front() if it has to go
+ * back. */
+void *
+pq_pop(PrioQueue *q, PqStamp *stamp)
+{
+   int i = choose_lane(q);
+   Lane *l;
+   Node *n;
+   void *item;
+
+   if (i < 0)
+      return NULL;
+   l = &q->lanes[i];
+   n = l->head;
+   if ((l->head = n->next) == NULL)
+      l->tail = NULL;
+   l->length--;
+   q->length--;
+
+   item = n->item;
+   stamp->lane = i;
+   stamp->queued = n->queued;
+   stamp->taken = now_us();
+   n->next = q->free_nodes;
+   q->free_nodes = n;
+   return item;
+}
+
+/* An item taken off the queue has left it for good: count the time it
+ * waited, from when it was first queued to when it was last taken, so
+ * one that went back and forth counts once. */
+void
+pq_done(PrioQueue *q, const PqStamp *stamp)
+{
+   count_wait(&q->lanes[stamp->lane], stamp->taken - stamp->queued);
+}
+
+int
+pq_length(PrioQueue *q)
+{
+   return q->length;
+}
+
+static long long
+percentile_us(Lane *l, double fraction)
+{
+   long want = (long) (fraction * l->count), seen = 0;
+   int b;
+
+   for (b = 0; b < NBUCKETS; b++)
+      if ((seen += l->buckets[b]) > want || seen == l->count)
+	 break;
+   return 1LL << b;
+}
+
+/* One line per lane: how many items left it since the last report,
+ * how long they waited, and how many are still waiting. */
+void
+pq_report(PrioQueue *q, FILE *f, const char *prefix, const char **names)
+{
+   Lane *l;
+   int i, b;
+
+   for (i = 0; i < q->nlanes; i++) {
+      l = &q->lanes[i];
+      if (l->count == 0)
+	 fprintf(f, "%s: %s: 0 sent, %d queued\n", prefix, names[i],
+		 l->length);
+      else
+	 fprintf(f, "%s: %s: %ld sent, wait avg %.3f ms, p99 < %.3f ms, "
+		 "max %.3f ms, %d queued\n", prefix, names[i], l->count,
+		 l->total_us / l->count / 1000.0,
+		 percentile_us(l, 0.99) / 1000.0, l->max_us / 1000.0,
+		 l->length);
+      l->count = 0;
+      l->total_us = 0;
+      l->max_us = 0;
+      for (b = 0; b < NBUCKETS; b++)
+	 l->buckets[b] = 0;
+   }
+}
+
+void
+pq_free(PrioQueue *q)
+{
+   Node *n, *next;
+   int i;
+
+   for (i = 0; i < q->nlanes; i++)
+      for (n = q->lanes[i].head; n != NULL; n = next) {
+	 next = n->next;
+	 free(n);
+      }
+   for (n = q->free_nodes; n != NULL; n = next) {
+      next = n->next;
+      free(n);
+   }
+   free(q->lanes);
+   free(q);
+}
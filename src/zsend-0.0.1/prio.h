@@ -0,0 +1,58 @@
+/*
+   prio.h  multi-level priority queue with starvation protection
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+   A PrioQueue holds items in a fixed number of FIFO lanes, lane 0
+   being the most urgent.  pq_pop() takes from the most urgent lane
+   that has anything in it, except that after every starve_ratio
+   items taken while a less urgent lane was waiting, it takes one from
+   whichever lower lane has waited longest.  So a flood in one lane
+   delays the others by at most one item in starve_ratio, and never
+   stops them.
+
+   Each lane keeps the time its items spent queued, which pq_report()
+   prints and then clears.  An item's wait is counted by pq_done(), once
+   the caller is finished with it.  Until then it may be put back with
+   pq_push_front(), keeping the time it was first queued, so its lane's
+   turn is not reset and its wait is counted once, in full.
+  */
+
+#ifndef PRIO_H
+#define PRIO_H
+
+#include <stdio.h>
+
+typedef struct PrioQueue PrioQueue;
+
+/* What pq_pop() says of an item it took */
+typedef struct PqStamp PqStamp;
+struct PqStamp {
+   int		lane;
+   long long	queued;		/* when first queued, usec */
+   long long	taken;		/* when last taken */
+};
+
+extern PrioQueue *pq_new(int nlanes, int starve_ratio);
+extern int pq_push(PrioQueue *q, int lane, void *item);
+extern int pq_push_front(PrioQueue *q, void *item, const PqStamp *stamp);
+extern void *pq_pop(PrioQueue *q, PqStamp *stamp);
+extern void pq_done(PrioQueue *q, const PqStamp *stamp);
+extern int pq_length(PrioQueue *q);
+extern void pq_report(PrioQueue *q, FILE *f, const char *prefix,
+		      const char **names);
+extern void pq_free(PrioQueue *q);
+
+#endif /* PRIO_H */
@@ -0,0 +1,483 @@
+/*
+   spool.c  durable, append-only spool of accepted notices
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "lread.h"
+#include "spool.h"
+
+/* Rewrite the file once it is this big and mostly dead records. */
+#define COMPACT_BYTES	(4 * 1024 * 1024)
+
+struct Spool {
+   char		*path;
+   int		fd;
+   off_t	file_size;
+   long		next_id;
+
+   SpoolEntry	*live;		/* not yet done, oldest first */
+   SpoolEntry	**live_tail;
+   long		live_bytes;
+
+   int		max_batch;
+   int		max_wait_ms;
+
+   char		*batch;		/* records not yet written */
+   int		batch_len;
+   int		batch_size;
+   int		batch_entries;	/* entry records in the batch */
+   long long	batch_start;	/* when the first record was added, ms */
+
+   /* for replay */
+   Value	*entry_pattern, *done_pattern;
+   Value	*m_id, *m_data;
+   int		skipped;	/* damaged records passed over */
+};
+
+/* in 64 bits, as a 32-bit long of milliseconds wraps in 24 days */
+static long long
+now_ms(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000L;
+}
+
+static SpoolEntry *
+new_entry(Spool *sp, long id, const char *data, int len)
+{
+   SpoolEntry *e = (SpoolEntry *) malloc(sizeof(SpoolEntry));
+
+   e->id = id;
+   e->len = len;
+   e->data = (char *) malloc(len);
+   memcpy(e->data, data, len);
+   e->synced = 0;
+   e->next = NULL;
+   *sp->live_tail = e;
+   sp->live_tail = &e->next;
+   sp->live_bytes += len;
+   return e;
+}
+
+/* Unlink e from the live list.  Entries are nearly always finished in
+ * the order they were accepted, so this is usually the head. */
+static void
+unlink_entry(Spool *sp, SpoolEntry *e)
+{
+   SpoolEntry **pp;
+
+   for (pp = &sp->live; *pp != NULL; pp = &(*pp)->next)
+      if (*pp == e) {
+	 *pp = e->next;
+	 if (sp->live_tail == &e->next)
+	    sp->live_tail = pp;
+	 sp->live_bytes -= e->len;
+	 return;
+      }
+}
+
+static void
+free_entry(SpoolEntry *e)
+{
+   free(e->data);
+   free(e);
+}
+
+/* Encode a record onto the end of the batch.  Returns 0, or -1 with
+ * errno set and the batch as it was. */
+static int
+add_record(Spool *sp, const char *what, long id, const char *data, int len)
+{
+   Value *v;
+   char *rec, *batch;
+   int reclen, size;
+
+   v = vmake_cons(vmake_integer(id), NULL);
+   if (data != NULL)
+      VCDR(v) = vmake_cons(vmake_string(len, (char *) data), NULL);
+   v = vmake_cons(vmake_symbol_c((char *) what), v);
+   reclen = vencode(v, &rec);
+   free_value_nodes(v);
+   if (reclen < 0) {
+      errno = ENOMEM;
+      return -1;
+   }
+
+   if (sp->batch_len + reclen > sp->batch_size) {
+      for (size = sp->batch_size; sp->batch_len + reclen > size; )
+	 size = size ? 2 * size : 65536;
+      if ((batch = (char *) realloc(sp->batch, size)) == NULL) {
+	 free(rec);
+	 errno = ENOMEM;
+	 return -1;
+      }
+      sp->batch = batch;
+      sp->batch_size = size;
+   }
+   if (sp->batch_len == 0)
+      sp->batch_start = now_ms();
+   memcpy(sp->batch + sp->batch_len, rec, reclen);
+   sp->batch_len += reclen;
+   free(rec);
+   return 0;
+}
+
+static int
+write_all(int fd, const char *buf, int len)
+{
+   ssize_t n;
+
+   while (len > 0) {
+      if ((n = write(fd, buf, len)) < 0) {
+	 if (errno == EINTR)
+	    continue;
+	 return -1;
+      }
+      buf += n;
+      len -= n;
+   }
+   return 0;
+}
+
+/* fsync the directory holding path, so a rename into it is durable. */
+static int
+sync_dir(const char *path)
+{
+   char *dir = strdup(path);
+   char *slash = strrchr(dir, '/');
+   int fd, ret;
+
+   if (slash == NULL)
+      strcpy(dir, ".");
+   else if (slash == dir)
+      slash[1] = '\0';
+   else
+      *slash = '\0';
+   if ((fd = open(dir, O_RDONLY)) < 0) {
+      free(dir);
+      return -1;
+   }
+   ret = fsync(fd);
+   close(fd);
+   free(dir);
+   return ret;
+}
+
+/* Replace the file with one holding just the live entries. */
+static int
+compact(Spool *sp)
+{
+   char *tmp = (char *) malloc(strlen(sp->path) + 5);
+   SpoolEntry *e;
+   int fd;
+
+   sprintf(tmp, "%s.new", sp->path);
+   if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600)) < 0) {
+      free(tmp);
+      return -1;
+   }
+   /* the batch is empty here, so borrow it to build the new file */
+   for (e = sp->live; e != NULL; e = e->next)
+      if (add_record(sp, "entry", e->id, e->data, e->len) < 0)
+	 break;
+   if (e != NULL ||
+       write_all(fd, sp->batch, sp->batch_len) < 0 || fsync(fd) < 0 ||
+       rename(tmp, sp->path) < 0) {
+      close(fd);
+      unlink(tmp);
+      free(tmp);
+      sp->batch_len = 0;
+      return -1;
+   }
+   free(tmp);
+   close(sp->fd);
+   sp->fd = fd;
+   sp->file_size = sp->batch_len;
+   sp->batch_len = 0;
+   return sync_dir(sp->path);
+}
+
+/* The length of the record framed at the start of buf, going by its
+ * length prefix: 0 if buf ends before the record does, -1 if buf does
+ * not start with a frame at all. */
+static int
+frame_length(const char *buf, int len)
+{
+   const unsigned char *p = (const unsigned char *) buf;
+   unsigned long body = 0;
+   int i, shift;
+
+   if (p[0] != VBIN_MAGIC)
+      return -1;
+   for (i = 1, shift = 0; ; i++, shift += 7) {
+      if (i >= len)
+	 return 0;
+      if (shift > 28)
+	 return -1;
+      body |= (unsigned long) (p[i] & 0x7f) << shift;
+      if (!(p[i] & 0x80))
+	 break;
+   }
+   if (body > 0x7fffffffUL - 16)
+      return -1;
+   return body > (unsigned long) (len - i - 1) ? 0 : i + 1 + (int) body;
+}
+
+/* Load the live entries from the file.  A record cut short at the end
+ * is a torn write, and is truncated away; a damaged record before that
+ * is passed over by its length prefix.  Returns -1 with errno set if
+ * the file holds something that is not a record at all. */
+static int
+replay(Spool *sp, char *buf, int len)
+{
+   SpoolEntry *e;
+   Value *v;
+   int off = 0, n;
+   long id;
+
+   while (off < len) {
+      if ((n = frame_length(buf + off, len - off)) < 0) {
+	 errno = EINVAL;
+	 return -1;
+      }
+      if (n == 0)
+	 break;
+      if (vdecode(n, buf + off, &v, 1) != n) {
+	 sp->skipped++;
+	 off += n;
+	 continue;
+      }
+      off += n;
+      if (destructure(sp->entry_pattern, v)) {
+	 id = VINTEGER(sp->m_id);
+	 e = new_entry(sp, id, VSDATA(sp->m_data), VSLENGTH(sp->m_data));
+	 e->synced = 1;
+	 if (id >= sp->next_id)
+	    sp->next_id = id + 1;
+      }
+      else if (destructure(sp->done_pattern, v)) {
+	 id = VINTEGER(sp->m_id);
+	 for (e = sp->live; e != NULL; e = e->next)
+	    if (e->id == id) {
+	       unlink_entry(sp, e);
+	       free_entry(e);
+	       break;
+	    }
+      }
+      free_value_nodes(v);
+   }
+   if (off < len && ftruncate(sp->fd, off) == 0)
+      len = off;
+   sp->file_size = len;
+   return 0;
+}
+
+/* Open (creating if need be) the spool at path and replay it.  Returns
+ * NULL with errno set on failure. */
+Spool *
+spool_open(const char *path, int max_batch, int max_wait_ms)
+{
+   Spool *sp = (Spool *) calloc(1, sizeof(Spool));
+   SpoolEntry *e, *next;
+   struct stat st;
+   char *buf;
+   ssize_t n;
+   int got, err;
+
+   sp->path = strdup(path);
+   sp->live = NULL;
+   sp->live_tail = &sp->live;
+   sp->next_id = 1;
+   sp->max_batch = max_batch > 0 ? max_batch : 1;
+   sp->max_wait_ms = max_wait_ms >= 0 ? max_wait_ms : 0;
+   sp->entry_pattern =
+      vmake_cons(vmake_symbol_c("entry"),
+		 vmake_cons(vmake_var(integer, (void **) &sp->m_id),
+			    vmake_cons(vmake_var(string,
+						 (void **) &sp->m_data),
+				       NULL)));
+   sp->done_pattern =
+      vmake_cons(vmake_symbol_c("done"),
+		 vmake_cons(vmake_var(integer, (void **) &sp->m_id), NULL));
+
+   if ((sp->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0600)) < 0 ||
+       fstat(sp->fd, &st) < 0)
+      goto fail;
+   buf = (char *) malloc(st.st_size + 1);
+   for (got = 0; got < st.st_size; got += n) {
+      if ((n = read(sp->fd, buf + got, st.st_size - got)) <= 0) {
+	 if (n < 0 && errno == EINTR) {
+	    n = 0;
+	    continue;
+	 }
+	 break;
+      }
+   }
+   if (replay(sp, buf, got) < 0) {
+      free(buf);
+      goto fail;
+   }
+   free(buf);
+   return sp;
+
+ fail:
+   err = errno;
+   if (sp->fd >= 0)
+      close(sp->fd);
+   for (e = sp->live; e != NULL; e = next) {
+      next = e->next;
+      free_entry(e);
+   }
+   free_value_nodes(sp->entry_pattern);
+   free_value_nodes(sp->done_pattern);
+   free(sp->path);
+   free(sp);
+   errno = err;
+   return NULL;
+}
+
+/* Accept data as a new entry.  It is durable after the next spool_sync().
+ * Returns NULL with errno set if it could not be taken. */
+SpoolEntry *
+spool_append(Spool *sp, const char *data, int len)
+{
+   SpoolEntry *e = new_entry(sp, sp->next_id++, data, len);
+
+   if (add_record(sp, "entry", e->id, data, len) < 0) {
+      unlink_entry(sp, e);
+      free_entry(e);
+      return NULL;
+   }
+   sp->batch_entries++;
+   return e;
+}
+
+/* e has been sent; forget it.  The done record is not fsynced on its
+ * own, so after a crash an entry may be sent twice but never lost; the
+ * same goes if there is no memory for the record. */
+void
+spool_done(Spool *sp, SpoolEntry *e)
+{
+   unlink_entry(sp, e);
+   (void) add_record(sp, "done", e->id, NULL, 0);
+   free_entry(e);
+}
+
+SpoolEntry *
+spool_live(Spool *sp)
+{
+   return sp->live;
+}
+
+/* How many damaged records spool_open() passed over. */
+int
+spool_skipped(Spool *sp)
+{
+   return sp->skipped;
+}
+
+int
+spool_sync_due(Spool *sp)
+{
+   return (sp->batch_len > 0 &&
+	   (sp->batch_entries >= sp->max_batch ||
+	    now_ms() - sp->batch_start >= sp->max_wait_ms));
+}
+
+/* Milliseconds until spool_sync_due() will be true, for poll(); -1 if
+ * there is nothing to sync. */
+int
+spool_sync_timeout(Spool *sp)
+{
+   long long left;
+
+   if (sp->batch_len == 0)
+      return -1;
+   if (sp->batch_entries >= sp->max_batch)
+      return 0;
+   left = sp->batch_start + sp->max_wait_ms - now_ms();
+   return left > 0 ? (int) left : 0;
+}
+
+/* Write the batch and, if it holds new entries, fsync it.  Returns 0,
+ * or -1 with errno set, in which case nothing in the batch is known to
+ * be durable and the batch is kept for another try. */
+int
+spool_sync(Spool *sp)
+{
+   SpoolEntry *e;
+   int err;
+
+   if (sp->batch_len == 0)
+      return 0;
+
+   if (sp->live == NULL) {
+      /* everything ever spooled is done; start the file over */
+      if (ftruncate(sp->fd, 0) < 0)
+	 return -1;
+      sp->file_size = 0;
+   }
+   else {
+      if (write_all(sp->fd, sp->batch, sp->batch_len) < 0 ||
+	  (sp->batch_entries > 0 && fdatasync(sp->fd) < 0)) {
+	 /* drop whatever part of the batch got out, so the retry does
+	  * not leave half a record, or a second copy, behind it */
+	 err = errno;
+	 (void) ftruncate(sp->fd, sp->file_size);
+	 errno = err;
+	 return -1;
+      }
+      sp->file_size += sp->batch_len;
+   }
+   sp->batch_len = 0;
+   sp->batch_entries = 0;
+   for (e = sp->live; e != NULL; e = e->next)
+      e->synced = 1;
+
+   if (sp->file_size > COMPACT_BYTES && sp->live_bytes < sp->file_size / 4)
+      (void) compact(sp);
+   return 0;
+}
+
+void
+spool_close(Spool *sp)
+{
+   SpoolEntry *e, *next;
+
+   (void) spool_sync(sp);
+   close(sp->fd);
+   for (e = sp->live; e != NULL; e = next) {
+      next = e->next;
+      free_entry(e);
+   }
+   free_value_nodes(sp->entry_pattern);
+   free_value_nodes(sp->done_pattern);
+   free(sp->batch);
+   free(sp->path);
+   free(sp);
+}
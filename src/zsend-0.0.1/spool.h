@@ -0,0 +1,63 @@
+/*
+   spool.h  durable, append-only spool of accepted notices
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+   Entries are appended to an in-memory batch and become durable only
+   when spool_sync() writes the batch and fsyncs it, so one fsync covers
+   every entry appended since the last one (group commit).  The caller
+   decides when to sync; spool_sync_due() says whether the batch has
+   reached max_batch entries or its oldest entry has waited max_wait_ms.
+
+   Records are lread values in binary encoding:
+
+      (entry <id> "<data>")
+      (done <id>)
+
+   spool_open() replays the file, so entries appended but never marked
+   done, i.e. not yet sent, are on the live list again after a restart.
+   A record cut short at the end of the file is a torn write and is
+   dropped; a damaged record before that is passed over by its length
+   prefix and counted by spool_skipped().
+  */
+
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include "prio.h"
+
+typedef struct SpoolEntry SpoolEntry;
+struct SpoolEntry {
+   long		id;
+   int		len;
+   char		*data;
+   int		synced;		/* covered by an fsync */
+   PqStamp	stamp;		/* the caller's, while it is being sent */
+   SpoolEntry	*next;
+};
+
+typedef struct Spool Spool;
+
+extern Spool *spool_open(const char *path, int max_batch, int max_wait_ms);
+extern SpoolEntry *spool_append(Spool *sp, const char *data, int len);
+extern void spool_done(Spool *sp, SpoolEntry *e);
+extern SpoolEntry *spool_live(Spool *sp);
+extern int spool_skipped(Spool *sp);
+extern int spool_sync_due(Spool *sp);
+extern int spool_sync_timeout(Spool *sp);
+extern int spool_sync(Spool *sp);
+extern void spool_close(Spool *sp);
+
+#endif /* SPOOL_H */
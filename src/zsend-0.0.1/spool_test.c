@@ -0,0 +1,238 @@
+/*
+   spool_test.c  tests for the spool's replay, torn tails and compaction
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+   Each test writes a spool in a scratch directory, damages or grows
+   the file as a crash or a long run would, and opens it again to see
+   what comes back.  Run by "make check"; prints what failed, and exits
+   non-zero if anything did.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "spool.h"
+
+static char path[256];
+static int failures;
+
+#define CHECK(cond) \
+   do { if (!(cond)) { \
+      fprintf(stderr, "%s:%d: %s: failed: %s\n", __FILE__, __LINE__, \
+	      test, #cond); \
+      failures++; \
+   } } while (0)
+
+static off_t
+file_size(void)
+{
+   struct stat st;
+
+   return stat(path, &st) < 0 ? -1 : st.st_size;
+}
+
+static int
+nlive(Spool *sp)
+{
+   SpoolEntry *e;
+   int n = 0;
+
+   for (e = spool_live(sp); e != NULL; e = e->next)
+      n++;
+   return n;
+}
+
+static void
+append_bytes(const char *data, int len)
+{
+   int fd = open(path, O_WRONLY | O_APPEND);
+
+   if (fd < 0 || write(fd, data, len) != len) {
+      perror(path);
+      exit(1);
+   }
+   close(fd);
+}
+
+/* A fresh spool holding entries "one", "two" and "three", the second
+ * done, all synced. */
+static void
+make_spool(void)
+{
+   Spool *sp;
+
+   unlink(path);
+   sp = spool_open(path, 1, 0);
+   spool_append(sp, "one", 3);
+   spool_done(sp, spool_append(sp, "two", 3));
+   spool_append(sp, "three", 5);
+   spool_sync(sp);
+   spool_close(sp);
+}
+
+static void
+test_replay(void)
+{
+   const char *test = "replay";
+   Spool *sp;
+   SpoolEntry *e;
+
+   make_spool();
+   CHECK((sp = spool_open(path, 1, 0)) != NULL);
+   if (sp == NULL)
+      return;
+   CHECK(nlive(sp) == 2);
+   CHECK(spool_skipped(sp) == 0);
+   e = spool_live(sp);
+   CHECK(e->id == 1 && e->len == 3 && !memcmp(e->data, "one", 3));
+   CHECK(e->synced);
+   e = e->next;
+   CHECK(e->id == 3 && e->len == 5 && !memcmp(e->data, "three", 5));
+   /* ids carry on from the file */
+   e = spool_append(sp, "four", 4);
+   CHECK(e->id == 4);
+   spool_close(sp);
+}
+
+static void
+test_torn_tail(void)
+{
+   const char *test = "torn tail";
+   Spool *sp;
+   off_t size;
+   int i;
+
+   make_spool();
+   size = file_size();
+   /* the start of a record whose body never made it, and a length
+    * prefix cut off in the middle */
+   for (i = 0; i < 2; i++) {
+      if (i == 0)
+	 append_bytes("\xb1\x20(entry", 7);
+      else
+	 append_bytes("\xb1\x80", 2);
+      CHECK((sp = spool_open(path, 1, 0)) != NULL);
+      if (sp == NULL)
+	 return;
+      CHECK(nlive(sp) == 2);
+      CHECK(spool_skipped(sp) == 0);
+      CHECK(file_size() == size);
+      spool_close(sp);
+   }
+}
+
+static void
+test_damaged(void)
+{
+   const char *test = "damaged record";
+   Spool *sp;
+   char buf[4096];
+   int fd, len, first;
+
+   make_spool();
+   fd = open(path, O_RDWR);
+   len = read(fd, buf, sizeof(buf));
+   /* spoil the body of the first record, keeping its length prefix */
+   first = 2 + (unsigned char) buf[1];
+   buf[first - 1] = 'x';
+   lseek(fd, 0, SEEK_SET);
+   CHECK(write(fd, buf, len) == len);
+   close(fd);
+
+   CHECK((sp = spool_open(path, 1, 0)) != NULL);
+   if (sp == NULL)
+      return;
+   CHECK(spool_skipped(sp) == 1);
+   CHECK(nlive(sp) == 1);
+   CHECK(spool_live(sp)->id == 3);
+   CHECK(file_size() == len);
+   spool_close(sp);
+
+   /* bytes that are not a record at all are refused */
+   append_bytes("garbage!", 8);
+   errno = 0;
+   CHECK(spool_open(path, 1, 0) == NULL);
+   CHECK(errno == EINVAL);
+}
+
+static void
+test_compaction(void)
+{
+   const char *test = "compaction";
+   static char data[1000];
+   SpoolEntry *keep, *e;
+   Spool *sp;
+   int i;
+
+   unlink(path);
+   memset(data, 'z', sizeof(data));
+   sp = spool_open(path, 1000000, 1000000);
+   keep = spool_append(sp, "keep", 4);
+   for (i = 0; i < 5000; i++)
+      spool_append(sp, data, sizeof(data));
+   CHECK(spool_sync(sp) == 0);
+   CHECK(file_size() > 5000 * (off_t) sizeof(data));
+   while ((e = spool_live(sp)->next) != NULL)
+      spool_done(sp, e);
+   /* the file is mostly done records now, so this rewrites it */
+   CHECK(spool_sync(sp) == 0);
+   CHECK(file_size() < 100);
+   CHECK(spool_live(sp) == keep && keep->next == NULL);
+   spool_append(sp, "more", 4);
+   CHECK(spool_sync(sp) == 0);
+   spool_close(sp);
+
+   CHECK((sp = spool_open(path, 1, 0)) != NULL);
+   if (sp == NULL)
+      return;
+   CHECK(nlive(sp) == 2);
+   e = spool_live(sp);
+   CHECK(e->id == 1 && e->len == 4 && !memcmp(e->data, "keep", 4));
+   CHECK(e->next->id == 5002);
+   spool_close(sp);
+}
+
+int
+main(void)
+{
+   char dir[] = "/tmp/spool_testXXXXXX";
+
+   if (mkdtemp(dir) == NULL) {
+      perror("mkdtemp");
+      return 1;
+   }
+   snprintf(path, sizeof(path), "%s/spool", dir);
+
+   test_replay();
+   test_torn_tail();
+   test_damaged();
+   test_compaction();
+
+   unlink(path);
+   rmdir(dir);
+   if (failures > 0) {
+      fprintf(stderr, "spool_test: %d failed\n", failures);
+      return 1;
+   }
+   printf("spool_test: ok\n");
+   return 0;
+}
@@ -0,0 +1,334 @@
+/*
+   zrecv.c  zephyr receiver printing notices as s-expressions
+   Copyright (C) 1994 Darrell Kindred
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+   zrecv subscribes to the triples on its command line and writes each
+   notice it receives to stdout as one line, an alist in the style tzc
+   uses:
+
+      ((tzcspew . message) (kind . acked) (class . "zcommit")
+       (instance . "1a2b3c4d") (opcode . "") (sender . "daemon.zcommit")
+       (recipient . "") (port . 1234) (auth . yes)
+       (time . "Mon Oct 19 11:00:00 2026") (fromhost . "18.9.22.69")
+       (message "refs/heads/master" "..."))
+
+   which lread's parse() reads back.  Notices are formatted straight
+   into one output buffer, and the buffer is written once for each
+   batch that zsend_receive() drains from the port, or sooner if it
+   fills up.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <zephyr/zephyr.h>
+#include <zephyr/zephyr_err.h>
+
+#include "evloop.h"
+#include "zsend.h"
+
+extern Code_t ZCheckAuthentication();
+
+/* Write the buffer out once it holds this much. */
+#define OUT_FLUSH	(64 * 1024)
+
+struct Globals {
+   const char	*program;
+   int		debug;
+   EvLoop	*loop;
+   ZSendSession	*session;
+
+   char		*out;
+   int		out_len;
+   int		out_size;
+};
+
+struct Globals global_storage, *globals = &global_storage;
+
+void usage(const char *progname) {
+   fprintf(stderr, "usage: %s [options] class[,instance[,recipient]] ...\n",
+	   progname);
+   fprintf(stderr, "   instance and recipient default to \"*\"\n");
+   fprintf(stderr, "   options:\n");
+   fprintf(stderr, "      -d             print debugging information\n");
+}
+
+char *auth_string(int n) {
+   switch (n) {
+    case ZAUTH_YES    : return "yes";
+    case ZAUTH_FAILED : return "failed";
+    case ZAUTH_NO     : return "no";
+    default           : return "bad-auth-value";
+   }
+}
+
+char *kind_string(int n) {
+   switch (n) {
+    case UNSAFE:    return "unsafe";
+    case UNACKED:   return "unacked";
+    case ACKED:     return "acked";
+    case HMACK:     return "hmack";
+    case HMCTL:     return "hmctl";
+    case SERVACK:   return "servack";
+    case SERVNAK:   return "servnak";
+    case CLIENTACK: return "clientack";
+    case STAT:      return "stat";
+    default:        return "bad-kind-value";
+   }
+}
+
+/* warning: this uses ctime which returns a pointer to a static buffer
+ * which is overwritten with each call. */
+char *time_str(time_t time_num)
+{
+    char *now_name;
+    now_name = ctime(&time_num);
+    now_name[24] = '\0';	/* dump newline at end */
+    return(now_name);
+}
+
+static void
+flush_out(void)
+{
+   char *p = globals->out;
+   int left = globals->out_len;
+   ssize_t n;
+
+   while (left > 0) {
+      if ((n = write(1, p, left)) < 0) {
+	 if (errno == EINTR)
+	    continue;
+	 perror("write");
+	 exit(1);
+      }
+      p += n;
+      left -= n;
+   }
+   globals->out_len = 0;
+}
+
+/* Make room for len more bytes and return where they go. */
+static char *
+out_room(int len)
+{
+   if (globals->out_len + len > globals->out_size) {
+      while (globals->out_len + len > globals->out_size)
+	 globals->out_size *= 2;
+      globals->out = (char *) realloc(globals->out, globals->out_size);
+   }
+   return globals->out + globals->out_len;
+}
+
+static void
+out_bytes(const char *s, int len)
+{
+   memcpy(out_room(len), s, len);
+   globals->out_len += len;
+}
+
+#define out_str(s)	out_bytes((s), strlen(s))
+
+/* A string as lread reads it: quoted, with '"' and '\' escaped and
+ * control characters escaped, so that a notice stays on one line. */
+static void
+out_quoted(const char *s, int len)
+{
+   char *p = out_room(4 * len + 2), *start = p;
+   unsigned char c;
+   int i;
+
+   *p++ = '"';
+   for (i = 0; i < len; i++) {
+      c = (unsigned char) s[i];
+      if (c == '"' || c == '\\') {
+	 *p++ = '\\';
+	 *p++ = c;
+      }
+      else if (c == '\n') {
+	 *p++ = '\\';
+	 *p++ = 'n';
+      }
+      else if (c == '\t') {
+	 *p++ = '\\';
+	 *p++ = 't';
+      }
+      else if (c < ' ' || c == 0177) {
+	 *p++ = '\\';
+	 *p++ = '0' + (c >> 6);
+	 *p++ = '0' + ((c >> 3) & 7);
+	 *p++ = '0' + (c & 7);
+      }
+      else
+	 *p++ = c;
+   }
+   *p++ = '"';
+   globals->out_len += p - start;
+}
+
+static void
+out_field(const char *key, const char *s)
+{
+   out_str(" (");
+   out_str(key);
+   out_str(" . ");
+   out_quoted(s ? s : "", s ? strlen(s) : 0);
+   out_str(")");
+}
+
+static void
+print_notice(ZSendSession *s, ZNotice_t *notice, struct sockaddr_in *from,
+	     void *arg)
+{
+   char num[32];
+   char *p, *end, *nul;
+
+   out_str("((tzcspew . message) (kind . ");
+   out_str(kind_string(notice->z_kind));
+   out_str(")");
+   out_field("class", notice->z_class);
+   out_field("instance", notice->z_class_inst);
+   out_field("opcode", notice->z_opcode);
+   out_field("sender", notice->z_sender);
+   out_field("recipient", notice->z_recipient);
+   out_bytes(num, snprintf(num, sizeof(num), " (port . %u)",
+			   (unsigned) ntohs(notice->z_port)));
+   out_str(" (auth . ");
+   out_str(auth_string(ZCheckAuthentication(notice, from)));
+   out_str(")");
+   out_field("time", time_str(notice->z_time.tv_sec));
+   out_field("fromhost", inet_ntoa(from->sin_addr));
+
+   /* the body is NUL-separated fields: signature, then the message */
+   out_str(" (message");
+   p = notice->z_message;
+   end = p + notice->z_message_len;
+   while (p < end) {
+      if ((nul = memchr(p, '\0', end - p)) == NULL)
+	 nul = end;
+      out_str(" ");
+      out_quoted(p, nul - p);
+      p = nul + 1;
+   }
+   out_str("))\n");
+
+   if (globals->out_len >= OUT_FLUSH)
+      flush_out();
+}
+
+static void
+zephyr_ready(EvLoop *loop, int fd, unsigned events, void *arg)
+{
+   zsend_receive(globals->session);
+   flush_out();
+}
+
+static void
+stop(EvLoop *loop, int signo, void *arg)
+{
+   ev_stop(loop);
+}
+
+/* Parse "class[,instance[,recipient]]"; arg is modified in place. */
+static void
+parse_sub(char *arg, ZSubscription_t *sub)
+{
+   char *comma;
+
+   sub->zsub_class = arg;
+   sub->zsub_classinst = "*";
+   sub->zsub_recipient = "*";
+   if ((comma = strchr(arg, ',')) != NULL) {
+      *comma = '\0';
+      sub->zsub_classinst = comma + 1;
+      if ((comma = strchr(comma + 1, ',')) != NULL) {
+	 *comma = '\0';
+	 sub->zsub_recipient = comma + 1;
+      }
+   }
+}
+
+int main(int argc, char *argv[]) {
+   ZSubscription_t *subs;
+   int nsubs, i, sw;
+   Code_t retval;
+
+   globals->program = strrchr(argv[0], '/');
+   if (globals->program == NULL)
+      globals->program = argv[0];
+   else
+      globals->program++;
+
+   while ((sw = getopt(argc, argv, "d")) != EOF)
+      switch (sw) {
+       case 'd':
+	 globals->debug = 1;
+	 break;
+       case '?':
+       default:
+	 usage(globals->program);
+	 exit(1);
+      }
+   if ((nsubs = argc - optind) == 0) {
+      usage(globals->program);
+      exit(1);
+   }
+   subs = (ZSubscription_t *) malloc(nsubs * sizeof(ZSubscription_t));
+   for (i = 0; i < nsubs; i++)
+      parse_sub(argv[optind + i], &subs[i]);
+
+   globals->out_size = 2 * OUT_FLUSH;
+   globals->out = (char *) malloc(globals->out_size);
+
+   if ((globals->loop = ev_new()) == NULL ||
+       ev_signal(globals->loop, SIGINT, stop, NULL) < 0 ||
+       ev_signal(globals->loop, SIGTERM, stop, NULL) < 0) {
+      perror("event loop");
+      exit(1);
+   }
+   if ((retval = zsend_open(&globals->session)) != ZERR_NONE) {
+      com_err(globals->program, retval, "while opening zephyr port");
+      exit(1);
+   }
+   zsend_set_receiver(globals->session, print_notice, NULL);
+   if ((retval = zsend_subscribe(globals->session, subs, nsubs)) != ZERR_NONE) {
+      com_err(globals->program, retval, "while subscribing");
+      zsend_close(globals->session);
+      exit(1);
+   }
+   if (globals->debug)
+      fprintf(stderr, "%s: subscribed to %d triples\n", globals->program,
+	      nsubs);
+   if (ev_add(globals->loop, zsend_fd(globals->session), EPOLLIN,
+	      zephyr_ready, NULL) < 0) {
+      perror("event loop");
+      exit(1);
+   }
+
+   if (ev_run(globals->loop) < 0)
+      perror("epoll_wait");
+
+   flush_out();
+   zsend_close(globals->session);
+   exit(0);
+}
@@ -0,0 +1,91 @@
+/*
+   zsend.h  in-process interface to the zsend sender
+   Copyright (C) 1994 Darrell Kindred
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+   libzsend holds the sending logic that used to live in zsend's main().
+   Open a session once, send any number of notices through it, and close
+   it.  Nothing here exits or prints; every call returns a Code_t from
+   the zephyr error table (ZERR_NONE on success), which can be turned
+   into text with error_message().
+
+   libzephyr keeps the port and its queue of incoming packets in global
+   state, so a process should have only one session open at a time.
+  */
+
+#ifndef ZSEND_H
+#define ZSEND_H
+
+#include <zephyr/zephyr.h>
+
+#define DEFAULT_CLASS "MESSAGE"
+#define DEFAULT_INSTANCE "PERSONAL"
+#define URGENT_INSTANCE "URGENT"
+#define DEFAULT_OPCODE ""
+#define FILSRV_CLASS "FILSRV"
+#ifdef CMU_INTERREALM
+#define DEFAULT_REALM "ANDREW.CMU.EDU"
+#endif
+
+typedef struct ZSendSession ZSendSession;
+
+/* Per-notice fields.  Strings are borrowed for the duration of the call. */
+typedef struct ZSendFields ZSendFields;
+struct ZSendFields {
+   const char	*class;
+   const char	*instance;
+   const char	*opcode;
+   const char	*sender;	/* NULL for the default sender */
+   const char	*signature;
+   const char	*realm;		/* CMU_INTERREALM only; NULL for none */
+   const char	*message;
+   int		message_len;	/* -1 if message is NUL-terminated */
+};
+
+extern void zsend_default_fields(ZSendFields *f);
+
+extern Code_t zsend_open(ZSendSession **sp);
+extern Code_t zsend_send(ZSendSession *s, const ZSendFields *f,
+			 int n_recips, const char **recips);
+extern void zsend_set_auth(ZSendSession *s, int authenticate);
+extern const char *zsend_failed_recipient(ZSendSession *s);
+extern int zsend_fd(ZSendSession *s);
+extern void zsend_close(ZSendSession *s);
+
+/* Asynchronous sending, for callers with their own event loop; see the
+ * comment above zsend_submit() in libzsend.c. */
+typedef void (*ZSendDone)(ZSendSession *s, Code_t code,
+			  const char *failed_recipient, void *arg);
+
+extern Code_t zsend_submit(ZSendSession *s, const ZSendFields *f,
+			   int n_recips, const char **recips,
+			   ZSendDone done, void *arg);
+extern void zsend_receive(ZSendSession *s);
+extern long zsend_timeout(ZSendSession *s);
+extern void zsend_expire(ZSendSession *s);
+extern int zsend_inflight(ZSendSession *s);
+
+/* Receiving; see zsend_subscribe() in libzsend.c.  The notice is freed
+ * when the receiver returns. */
+typedef void (*ZSendReceiver)(ZSendSession *s, ZNotice_t *notice,
+			      struct sockaddr_in *from, void *arg);
+
+extern Code_t zsend_subscribe(ZSendSession *s, ZSubscription_t *subs,
+			      int nsubs);
+extern void zsend_set_receiver(ZSendSession *s, ZSendReceiver receiver,
+			       void *arg);
+
+#endif /* ZSEND_H */
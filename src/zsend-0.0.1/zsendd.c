@@ -0,0 +1,1220 @@
+/*
+   zsendd.c  resident zephyr sender
+   Copyright (C) 1994 Darrell Kindred
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+   zsendd keeps one zephyr port open and accepts notices from local
+   clients over a SOCK_SEQPACKET Unix socket.  Each packet a client
+   sends is one submission, a printed alist:
+
+      ((class . "zcommit") (instance . "1a2b3c4d") (opcode . "")
+       (sender . "daemon.zcommit") (signature . "refs/heads/master")
+       (recipients "gdb" "broder") (message . "..."))
+
+   Every field is optional and defaults as in zsend.  The same alist
+   may instead be sent in lread's binary encoding (see vencode()),
+   which is recognized by its leading VBIN_MAGIC byte and decoded in
+   place without copying any strings.  Each submission is answered
+   with one packet:
+
+      ((status . 0))
+      ((status . <code>) (error . "<text>") (recipient . "<recipient>"))
+
+   where <code> is the zephyr error code the send ended with.  A '"'
+   or '\\' in a string is escaped with a backslash, and a field that
+   would make the reply too long is left out.
+
+   A submission may carry (trace . "<id>"), from a sampled request in
+   zcommit's tracer (ztrace.py).  Its reply then also says where its
+   time went in zsendd, as (<phase> <start> <duration>) triples in
+   microseconds of wall-clock time:
+
+      ((status . 0) (trace "<id>" (decode 1287158400000000 12)
+       (queue 1287158400000012 40) (send 1287158400000052 911)))
+
+   where send runs from handing the notice to zephyr until it is
+   acknowledged or fails.
+
+   With -s the phases are decode and spool, the wait for the fsync.
+
+   Everything runs on one epoll loop (evloop.c): notices go out with
+   zsend_submit() without waiting, the zephyr port is watched for the
+   host manager's acknowledgements, and a client's reply is sent when
+   its notice is acknowledged, so one process keeps many notices and
+   clients in flight at once.  At most -f notices are outstanding; past
+   that, notices queue, and once QUEUE_FACTOR times -f of them are
+   queued, clients are not read until some are acknowledged.  That goes
+   with -s too, so while zephyr cannot be reached the notices held in
+   memory stay bounded; the spool file keeps them across a restart.
+
+   Queued notices wait in one of three lanes: notices with instance
+   URGENT, then notices of the classes given with -u, then everything
+   else, such as bulk commit traffic.  A lane is served only while the
+   more urgent ones are empty, except that one notice in STARVE_RATIO+1
+   comes from the lower lane that has waited longest, so bulk traffic
+   keeps moving under a flood of urgent notices.  How long notices
+   waited in each lane is printed on SIGUSR1, every -r seconds, and on
+   exit with -d.
+
+   With -j, zsendd forks that many workers (pool.c), each with its own
+   zephyr port, and only decodes and routes submissions itself.  Notices
+   of one class and instance always go to the same worker, so they are
+   still sent in order.
+
+   With -s, submissions are appended to a durable spool (spool.c)
+   instead of being sent on the spot, and status 0 means the notice is
+   on disk.  One fsync covers every submission that arrives within -w
+   milliseconds, or -b submissions, whichever comes first; their replies
+   wait for it.  Spooled notices are then sent in order, retried with
+   backoff while the zephyr servers are failing, and replayed after a
+   restart if they were never sent.  Spooled notices go through the
+   same lanes once they are on disk, so a retry only reorders notices
+   within a lane.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <zephyr/zephyr.h>
+#include <zephyr/zephyr_err.h>
+
+#include "evloop.h"
+#include "lread.h"
+#include "pool.h"
+#include "prio.h"
+#include "spool.h"
+#include "zsend.h"
+
+/* Largest submission accepted; longer packets are refused. */
+#define MAX_SUBMISSION	(1024 * 1024)
+#define MAX_REPLY	1024
+#define MAX_TRACE_ID	64
+#define LISTEN_BACKLOG	128
+
+#define DEFAULT_SYNC_BATCH	64	/* submissions per fsync */
+#define DEFAULT_SYNC_WAIT	5	/* ms a submission may wait for one */
+#define DEFAULT_MAX_INFLIGHT	256	/* notices awaiting acknowledgement */
+#define MIN_RETRY_MS		250
+#define MAX_RETRY_MS		(60 * 1000)
+#define SYNC_RETRY_MS		1000
+#define STARVE_RATIO		8	/* urgent notices per bulk one, at worst */
+#define QUEUE_FACTOR		4	/* queued notices per -f */
+
+/* Lanes, most urgent first. */
+enum { LANE_URGENT, LANE_HIGH, LANE_BULK, NLANES };
+static const char *lane_names[NLANES] = { "urgent", "high", "bulk" };
+
+/* A connected client.  Sends in flight and spool waiters hold a
+ * reference, so a client that hangs up early is closed at once but
+ * freed only when nothing can reply to it any more. */
+typedef struct Client Client;
+struct Client {
+   int		fd;		/* -1 once closed */
+   int		refs;
+   int		paused;		/* not being read; too much queued */
+   Client	*prev, *next;
+};
+
+/* A submission that asked for its timings, and the client they go
+ * back to.  Marks are microseconds of wall-clock time at the start of
+ * each phase, and the end of the last. */
+typedef struct Trace Trace;
+struct Trace {
+   Client	*client;
+   char		id[MAX_TRACE_ID + 1];
+   long long	marks[4];	/* received, decoded, submitted,
+				   acknowledged; or received, decoded,
+				   synced with a spool */
+};
+
+/* A submission waiting to be sent, when there is no spool to keep it. */
+typedef struct Pending Pending;
+struct Pending {
+   Client	*client;
+   Trace	*trace;		/* NULL unless it asked for one */
+   int		len;
+   char		data[1];
+};
+
+/* A client owed a reply after the next sync. */
+typedef struct Waiter Waiter;
+struct Waiter {
+   Client	*client;
+   Trace	*trace;
+};
+
+/* A spooled notice not yet covered by an fsync, and its lane. */
+typedef struct Unsynced Unsynced;
+struct Unsynced {
+   SpoolEntry	*entry;
+   int		lane;
+};
+
+struct Globals {
+   const char	*program;
+   const char	*socket_path;
+   const char	*spool_path;
+   int		debug;
+   int		authenticate;
+
+   EvLoop	*loop;
+   ZSendSession	*session;
+   int		listen_fd;
+   Client	*clients;
+   int		nclients;
+
+   char		*packet;	/* receive buffer, MAX_SUBMISSION bytes */
+
+   int		nworkers;
+   Pool		*pool;		/* NULL to send from this process */
+   PoolWorker	*worker;	/* in a worker, its end of the ring */
+
+   int		max_inflight;
+   int		inflight;	/* submitted, not yet acknowledged */
+   EvTimer	*ack_timer;	/* for zsend_expire() */
+
+   PrioQueue	*queue;		/* Pendings, or SpoolEntries with a spool */
+   int		npaused;	/* clients not read while it is full */
+   const char	**high_classes;	/* -u */
+   int		nhigh_classes;
+   int		report_secs;
+   EvTimer	*report_timer;
+
+   Spool	*spool;		/* NULL to send straight away */
+   int		sync_batch;
+   int		sync_wait;
+   EvTimer	*sync_timer;
+   Waiter	*waiters;
+   int		nwaiters;
+   int		maxwaiters;
+   Unsynced	*unsynced;	/* queued once the next sync succeeds */
+   int		nunsynced;
+   int		maxunsynced;
+   EvTimer	*deliver_timer;	/* also the backoff while sends fail */
+   int		retry_ms;
+
+   /* alist keys, made once */
+   Value	*k_class, *k_instance, *k_opcode, *k_sender, *k_signature,
+		*k_realm, *k_recipients, *k_message, *k_trace;
+};
+
+struct Globals global_storage, *globals = &global_storage;
+
+void usage(const char *progname) {
+   fprintf(stderr, "usage: %s [options] -l <socket>\n", progname);
+   fprintf(stderr, "   options:\n");
+   fprintf(stderr, "      -l <socket>    listen for submissions on <socket>\n");
+   fprintf(stderr, "      -s <spool>     spool accepted notices to <spool> before sending\n");
+   fprintf(stderr, "      -b <count>     fsync the spool at least every <count> notices\n");
+   fprintf(stderr, "      -w <ms>        fsync the spool at least every <ms> milliseconds\n");
+   fprintf(stderr, "      -f <count>     keep at most <count> notices in flight\n");
+   fprintf(stderr, "      -j <count>     send from <count> worker processes\n");
+   fprintf(stderr, "      -u <class>     send notices of <class> ahead of others; repeatable\n");
+   fprintf(stderr, "      -r <seconds>   print queue latency every <seconds>\n");
+   fprintf(stderr, "      -a             send authenticated notices\n");
+   fprintf(stderr, "      -d             print debugging information\n");
+}
+
+/* A submission being decoded.  Printed submissions have their strings
+ * copied out of the parsed Value to NUL-terminate them; binary ones are
+ * decoded in place with NUL-terminated strings, which are borrowed. */
+typedef struct Submission Submission;
+struct Submission {
+   ZSendFields	fields;
+   int		n_recips;
+   char		**recips;
+   const char	*trace;		/* NULL unless the client asked */
+   int		borrowed;	/* strings point into the packet */
+   char		*strings[8];	/* fields to free */
+   int		nstrings;
+};
+
+static char *
+take(Submission *sub, Value *s)
+{
+   if (sub->borrowed)
+      return VSDATA(s);
+   return vextract_string_c(s);
+}
+
+static const char *
+take_string(Submission *sub, Value *alist, Value *key, const char *dflt)
+{
+   Value *pair = assqv(key, alist);
+   char *s;
+
+   if (pair == NULL || VTAG(VCDR(pair)) != string)
+      return dflt;
+   s = take(sub, VCDR(pair));
+   if (!sub->borrowed)
+      sub->strings[sub->nstrings++] = s;
+   return s;
+}
+
+static int
+decode_submission(Value *v, int borrowed, Submission *sub)
+{
+   Value *pair, *l;
+   int i;
+
+   bzero((char *) sub, sizeof(*sub));
+   sub->borrowed = borrowed;
+   zsend_default_fields(&sub->fields);
+   if (VTAG(v) != cons && VTAG(v) != nil)
+      return 0;
+
+   sub->fields.class = take_string(sub, v, globals->k_class, DEFAULT_CLASS);
+   sub->fields.instance = take_string(sub, v, globals->k_instance,
+				      DEFAULT_INSTANCE);
+   sub->fields.opcode = take_string(sub, v, globals->k_opcode,
+				    DEFAULT_OPCODE);
+   sub->fields.sender = take_string(sub, v, globals->k_sender, NULL);
+   sub->fields.signature = take_string(sub, v, globals->k_signature, "");
+   sub->fields.realm = take_string(sub, v, globals->k_realm, NULL);
+   sub->trace = take_string(sub, v, globals->k_trace, NULL);
+
+   if ((pair = assqv(globals->k_message, v)) != NULL &&
+       VTAG(VCDR(pair)) == string) {
+      sub->fields.message = take(sub, VCDR(pair));
+      sub->fields.message_len = VSLENGTH(VCDR(pair));
+      if (!borrowed)
+	 sub->strings[sub->nstrings++] = (char *) sub->fields.message;
+   }
+
+   if ((pair = assqv(globals->k_recipients, v)) != NULL) {
+      sub->n_recips = vlength(VCDR(pair));
+      sub->recips = (char **) malloc((sub->n_recips + 1) * sizeof(char *));
+      for (i = 0, l = VCDR(pair); VTAG(l) == cons; l = VCDR(l)) {
+	 if (VTAG(VCAR(l)) != string)
+	    continue;
+	 sub->recips[i++] = take(sub, VCAR(l));
+      }
+      sub->n_recips = i;
+   }
+   return 1;
+}
+
+static void
+free_submission(Submission *sub)
+{
+   int i;
+
+   for (i = 0; i < sub->nstrings; i++)
+      free(sub->strings[i]);
+   if (!sub->borrowed)
+      for (i = 0; i < sub->n_recips; i++)
+	 free(sub->recips[i]);
+   free(sub->recips);
+}
+
+/* Wall-clock microseconds, which overflow a 32-bit long. */
+static long long
+now_us(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_REALTIME, &ts);
+   return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static const char *send_phases[] = { "decode", "queue", "send" };
+static const char *spool_phases[] = { "decode", "spool" };
+
+/* Append s to the len bytes in buf, if it fits in limit; returns the
+ * new length, or -1, as it does given -1. */
+static int
+add_text(char *buf, int len, int limit, const char *s)
+{
+   int n = strlen(s);
+
+   if (len < 0 || len + n > limit)
+      return -1;
+   memcpy(buf + len, s, n);
+   return len + n;
+}
+
+/* The same for s as a string that lread reads back as s: quoted, with
+ * a backslash before any '"' or '\\' in it. */
+static int
+add_quoted(char *buf, int len, int limit, const char *s)
+{
+   if (len < 0 || len + 2 > limit)
+      return -1;
+   buf[len++] = '\"';
+   for (; *s != '\0'; s++) {
+      if (*s == '\"' || *s == '\\')
+	 buf[len++] = '\\';
+      if (len + 2 > limit)
+	 return -1;
+      buf[len++] = *s;
+   }
+   buf[len++] = '\"';
+   return len;
+}
+
+/* Reply, with t's timings if there is one; phases names them.  Fields
+ * that do not fit in a reply are left out, the status never. */
+static void
+reply_trace(Client *c, Code_t code, const char *recipient, Trace *t,
+	    const char **phases, int nphases)
+{
+   char buf[MAX_REPLY], phase[80];
+   int limit = sizeof(buf) - 1;		/* the closing paren */
+   int len, more, i;
+
+   if (c->fd < 0)
+      return;
+   len = snprintf(buf, sizeof(buf), "((status . %d)", (int) code);
+   if (code != ZERR_NONE) {
+      more = add_text(buf, len, limit, " (error . ");
+      more = add_quoted(buf, more, limit, error_message(code));
+      more = add_text(buf, more, limit, ")");
+      if (more >= 0)
+	 len = more;
+      more = add_text(buf, len, limit, " (recipient . ");
+      more = add_quoted(buf, more, limit, recipient ? recipient : "");
+      more = add_text(buf, more, limit, ")");
+      if (more >= 0)
+	 len = more;
+   }
+   if (t != NULL) {
+      more = add_text(buf, len, limit, " (trace ");
+      more = add_quoted(buf, more, limit, t->id);
+      for (i = 0; i < nphases; i++) {
+	 snprintf(phase, sizeof(phase), " (%s %lld %lld)", phases[i],
+		  t->marks[i], t->marks[i + 1] - t->marks[i]);
+	 more = add_text(buf, more, limit, phase);
+      }
+      more = add_text(buf, more, limit, ")");
+      if (more >= 0)
+	 len = more;
+   }
+   buf[len++] = ')';
+   /* a client that lets its socket fill up loses the reply rather than
+      stalling everyone else */
+   if (send(c->fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT) < 0 &&
+       globals->debug)
+      fprintf(stderr, "%s: reply: %s\n", globals->program, strerror(errno));
+}
+
+static void
+reply(Client *c, Code_t code, const char *recipient)
+{
+   reply_trace(c, code, recipient, NULL, NULL, 0);
+}
+
+/* Parse a packet, printed or binary, into a Submission.  On success
+ * *vp holds the parsed value, to be freed with free_packet(). */
+static int
+decode_packet(char *packet, int len, Value **vp, Submission *sub)
+{
+   int binary = (len > 0 && (unsigned char) packet[0] == VBIN_MAGIC);
+
+   if ((binary ? vdecode(len, packet, vp, 1) : parse(len, packet, vp)) <= 0)
+      return 0;
+   if (!decode_submission(*vp, binary, sub)) {
+      binary ? free_value_nodes(*vp) : free_value(*vp);
+      return 0;
+   }
+   return 1;
+}
+
+static void
+free_packet(Value *v, Submission *sub)
+{
+   int binary = sub->borrowed;
+
+   free_submission(sub);
+   binary ? free_value_nodes(v) : free_value(v);
+}
+
+static Client *
+client_ref(Client *c)
+{
+   c->refs++;
+   return c;
+}
+
+static void
+client_unref(Client *c)
+{
+   if (--c->refs == 0)
+      free(c);
+}
+
+static void read_client(EvLoop *loop, int fd, unsigned events, void *arg);
+static void pump(void);
+
+static void
+arm_ack_timer(void)
+{
+   ev_timer_set(globals->ack_timer, zsend_timeout(globals->session));
+}
+
+/* Something was acknowledged, so another notice may go out: but not
+ * from here, as we may be inside zsend_receive(). */
+static void
+sent_one(void)
+{
+   globals->inflight--;
+   if (globals->queue != NULL && pq_length(globals->queue) > 0 &&
+       ev_timer_pending(globals->deliver_timer) < 0)
+      ev_timer_set(globals->deliver_timer, 0);
+}
+
+static int
+lane_of(const ZSendFields *f)
+{
+   int i;
+
+   if (strcasecmp(f->instance, URGENT_INSTANCE) == 0)
+      return LANE_URGENT;
+   for (i = 0; i < globals->nhigh_classes; i++)
+      if (strcasecmp(f->class, globals->high_classes[i]) == 0)
+	 return LANE_HIGH;
+   return LANE_BULK;
+}
+
+/* Notices of one class and instance go to the same worker, so they
+ * stay in order.  Zephyr compares both without regard to case. */
+static unsigned
+shard_of(const ZSendFields *f)
+{
+   unsigned h = 2166136261u;
+   const char *s;
+
+   for (s = f->class; *s; s++)
+      h = (h ^ tolower((unsigned char) *s)) * 16777619u;
+   h *= 16777619u;
+   for (s = f->instance; *s; s++)
+      h = (h ^ tolower((unsigned char) *s)) * 16777619u;
+   return h;
+}
+
+/* Start sending the notice in packet.  done is called exactly once
+ * with the outcome: later, or right away if it could not be sent, in
+ * which case this returns 0. */
+static int
+submit_packet(char *packet, int len, ZSendDone done, void *arg)
+{
+   Submission sub;
+   Value *v;
+   Code_t retval;
+
+   globals->inflight++;
+   if (!decode_packet(packet, len, &v, &sub)) {
+      done(globals->session, ZERR_ILLVAL, NULL, arg);
+      return 0;
+   }
+   if (globals->pool != NULL) {
+      unsigned shard = shard_of(&sub.fields);
+      free_packet(v, &sub);
+      if (pool_submit(globals->pool, shard, packet, len, done, arg) < 0) {
+	 done(globals->session, errno, NULL, arg);
+	 return 0;
+      }
+      return 1;
+   }
+   retval = zsend_submit(globals->session, &sub.fields, sub.n_recips,
+			 (const char **) sub.recips, done, arg);
+   if (globals->debug || retval)
+      fprintf(stderr, "%s: class %s instance %s: %s\n", globals->program,
+	      sub.fields.class, sub.fields.instance,
+	      retval ? error_message(retval) : "submitted");
+   if (retval != ZERR_NONE)
+      done(globals->session, retval,
+	   zsend_failed_recipient(globals->session), arg);
+   else
+      arm_ack_timer();
+   free_packet(v, &sub);
+   return retval == ZERR_NONE;
+}
+
+static void
+client_sent(ZSendSession *s, Code_t code, const char *recipient, void *arg)
+{
+   Client *c = (Client *) arg;
+
+   reply(c, code, recipient);
+   client_unref(c);
+   sent_one();
+}
+
+static Trace *
+new_trace(Client *c, const char *id, long long received)
+{
+   Trace *t = (Trace *) calloc(1, sizeof(Trace));
+   int i;
+
+   if (t == NULL)
+      return NULL;		/* the notice matters more than its trace */
+   t->client = c;
+   /* it goes back inside quotes, so keep it tame */
+   for (i = 0; id[i] != '\0' && i < MAX_TRACE_ID; i++)
+      t->id[i] = isalnum((unsigned char) id[i]) ? id[i] : '_';
+   t->marks[0] = received;
+   t->marks[1] = now_us();
+   return t;
+}
+
+static void
+traced_sent(ZSendSession *s, Code_t code, const char *recipient, void *arg)
+{
+   Trace *t = (Trace *) arg;
+
+   t->marks[3] = now_us();
+   reply_trace(t->client, code, recipient, t, send_phases, 3);
+   client_unref(t->client);
+   free(t);
+   sent_one();
+}
+
+static void
+add_waiter(Client *c, Trace *t)
+{
+   if (globals->nwaiters == globals->maxwaiters) {
+      globals->maxwaiters = globals->maxwaiters ? 2 * globals->maxwaiters : 64;
+      globals->waiters = (Waiter *)
+	 realloc(globals->waiters, globals->maxwaiters * sizeof(Waiter));
+   }
+   globals->waiters[globals->nwaiters].client = client_ref(c);
+   globals->waiters[globals->nwaiters].trace = t;
+   globals->nwaiters++;
+}
+
+static void
+arm_sync_timer(void)
+{
+   long when = spool_sync_timeout(globals->spool);
+
+   /* no point waiting for more if every client is already waiting */
+   if (globals->nwaiters > 0 && globals->nwaiters >= globals->nclients)
+      when = 0;
+   if (when >= 0 && (ev_timer_pending(globals->sync_timer) < 0 ||
+		     ev_timer_pending(globals->sync_timer) > when))
+      ev_timer_set(globals->sync_timer, when);
+}
+
+static void
+add_unsynced(SpoolEntry *e, int lane)
+{
+   if (globals->nunsynced == globals->maxunsynced) {
+      globals->maxunsynced = globals->maxunsynced ?
+	 2 * globals->maxunsynced : 64;
+      globals->unsynced = (Unsynced *)
+	 realloc(globals->unsynced, globals->maxunsynced * sizeof(Unsynced));
+   }
+   globals->unsynced[globals->nunsynced].entry = e;
+   globals->unsynced[globals->nunsynced].lane = lane;
+   globals->nunsynced++;
+}
+
+/* Queue a spooled notice.  Returns 0, or -1 if there is no memory to
+ * queue it. */
+static int
+queue_entry(SpoolEntry *e)
+{
+   Submission sub;
+   Value *v;
+   int lane = LANE_BULK;	/* fails with ZERR_ILLVAL when its turn comes */
+
+   if (decode_packet(e->data, e->len, &v, &sub)) {
+      lane = lane_of(&sub.fields);
+      free_packet(v, &sub);
+   }
+   return pq_push(globals->queue, lane, e);
+}
+
+/* Accept a submission into the spool; the reply waits for the fsync. */
+static void
+spool_submission(Client *c, char *packet, int len, long long received)
+{
+   Submission sub;
+   SpoolEntry *e;
+   Value *v;
+   Trace *t = NULL;
+   int lane;
+
+   if (!decode_packet(packet, len, &v, &sub)) {
+      reply(c, ZERR_ILLVAL, NULL);
+      return;
+   }
+   lane = lane_of(&sub.fields);
+   if (sub.trace != NULL)
+      t = new_trace(c, sub.trace, received);
+   free_packet(v, &sub);
+   if ((e = spool_append(globals->spool, packet, len)) == NULL) {
+      reply_trace(c, errno, NULL, t, spool_phases, 1);
+      free(t);
+      return;
+   }
+   add_unsynced(e, lane);
+   add_waiter(c, t);
+   arm_sync_timer();
+}
+
+/* Queue a submission to be sent when its lane's turn comes. */
+static void
+queue_submission(Client *c, char *packet, int len, long long received)
+{
+   Submission sub;
+   Value *v;
+   Pending *p;
+   int lane;
+
+   if (!decode_packet(packet, len, &v, &sub)) {
+      reply(c, ZERR_ILLVAL, NULL);
+      return;
+   }
+   lane = lane_of(&sub.fields);
+   if ((p = (Pending *) malloc(sizeof(Pending) + len)) == NULL) {
+      free_packet(v, &sub);
+      reply(c, ENOMEM, NULL);
+      return;
+   }
+   p->client = client_ref(c);
+   p->trace = NULL;
+   if (sub.trace != NULL)
+      p->trace = new_trace(p->client, sub.trace, received);
+   free_packet(v, &sub);
+   p->len = len;
+   memcpy(p->data, packet, len);
+   if (pq_push(globals->queue, lane, p) < 0) {
+      reply_trace(p->client, ENOMEM, NULL, p->trace, send_phases, 1);
+      client_unref(p->client);
+      free(p->trace);
+      free(p);
+      return;
+   }
+   pump();
+}
+
+static void
+handle_submission(Client *c, char *packet, int len)
+{
+   long long received = now_us();
+
+   if (globals->spool != NULL)
+      spool_submission(c, packet, len, received);
+   else
+      queue_submission(c, packet, len, received);
+}
+
+/* Make the spool durable and answer everyone waiting on it. */
+static void
+sync_spool(EvLoop *loop, EvTimer *t, void *arg)
+{
+   Code_t code = ZERR_NONE;
+   Waiter *w;
+   int i, n;
+
+   if (spool_sync(globals->spool) < 0) {
+      /* the entries stay on the live list and go out if a later sync
+       * works, so a client told of this failure may see a duplicate */
+      code = errno;
+      fprintf(stderr, "%s: syncing spool: %s\n", globals->program,
+	      strerror(errno));
+      ev_timer_set(globals->sync_timer, SYNC_RETRY_MS);
+   }
+   for (i = 0; i < globals->nwaiters; i++) {
+      w = &globals->waiters[i];
+      if (w->trace != NULL)
+	 w->trace->marks[2] = now_us();
+      reply_trace(w->client, code, NULL, w->trace, spool_phases, 2);
+      client_unref(w->client);
+      free(w->trace);
+   }
+   globals->nwaiters = 0;
+   if (code != ZERR_NONE)
+      return;
+   /* any that cannot be queued for want of memory wait for a retry */
+   for (i = n = 0; i < globals->nunsynced; i++)
+      if (pq_push(globals->queue, globals->unsynced[i].lane,
+		  globals->unsynced[i].entry) < 0)
+	 globals->unsynced[n++] = globals->unsynced[i];
+   if ((globals->nunsynced = n) > 0)
+      ev_timer_set(globals->sync_timer, SYNC_RETRY_MS);
+   pump();
+}
+
+static void
+backoff(void)
+{
+   if (globals->retry_ms == 0)
+      globals->retry_ms = MIN_RETRY_MS;
+   else if ((globals->retry_ms *= 2) > MAX_RETRY_MS)
+      globals->retry_ms = MAX_RETRY_MS;
+   ev_timer_set(globals->deliver_timer, globals->retry_ms);
+}
+
+static void
+entry_sent(ZSendSession *s, Code_t code, const char *recipient, void *arg)
+{
+   SpoolEntry *e = (SpoolEntry *) arg;
+
+   sent_one();
+   if (code == ZERR_NONE || code == ZERR_ILLVAL) {
+      /* sent, or never going to be */
+      pq_done(globals->queue, &e->stamp);
+      spool_done(globals->spool, e);
+      globals->retry_ms = 0;
+      arm_sync_timer();
+   }
+   else {
+      fprintf(stderr, "%s: sending spooled notice to %s: %s\n",
+	      globals->program, recipient, error_message(code));
+      if (pq_push_front(globals->queue, e, &e->stamp) < 0)
+	 fprintf(stderr, "%s: no memory to retry it; it stays spooled "
+		 "until restart\n", globals->program);
+      backoff();
+   }
+}
+
+/* Notices accepted and not yet handed to zephyr: those queued, and with
+ * a spool those waiting for a sync, which are queued once it is done.
+ * Clients are not read while there are too many. */
+static int
+backlog(void)
+{
+   return pq_length(globals->queue) + globals->nunsynced;
+}
+
+/* Send queued notices, most urgent first, keeping up to -f in flight,
+ * and read from clients again if the queue has room.  On a failure
+ * that may be transient, spooled notices wait for the backoff; those
+ * already in flight behind a failed one still go out, so a retry can
+ * reorder them. */
+static void
+pump(void)
+{
+   SpoolEntry *e;
+   Pending *p;
+   Client *c;
+   PqStamp stamp;
+
+   while (globals->inflight < globals->max_inflight) {
+      if (globals->spool != NULL) {
+	 if (ev_timer_pending(globals->deliver_timer) > 0)
+	    break;		/* backing off */
+	 if ((e = (SpoolEntry *) pq_pop(globals->queue, &stamp)) == NULL)
+	    break;
+	 e->stamp = stamp;
+	 submit_packet(e->data, e->len, entry_sent, e);
+      }
+      else {
+	 if ((p = (Pending *) pq_pop(globals->queue, &stamp)) == NULL)
+	    break;
+	 pq_done(globals->queue, &stamp);
+	 if (p->trace == NULL)
+	    submit_packet(p->data, p->len, client_sent, p->client);
+	 else {
+	    /* traced_sent() may have freed the trace by the time this
+	     * returns, so the submit time is taken first */
+	    p->trace->marks[2] = now_us();
+	    submit_packet(p->data, p->len, traced_sent, p->trace);
+	 }
+	 free(p);
+      }
+   }
+
+   if (globals->npaused > 0 &&
+       backlog() < QUEUE_FACTOR * globals->max_inflight) {
+      for (c = globals->clients; c != NULL; c = c->next)
+	 if (c->paused) {
+	    c->paused = 0;
+	    ev_modify(globals->loop, c->fd, EPOLLIN);
+	 }
+      globals->npaused = 0;
+   }
+}
+
+static void
+deliver_ready(EvLoop *loop, EvTimer *t, void *arg)
+{
+   pump();
+}
+
+static void
+report_latency(EvLoop *loop, int signo, void *arg)
+{
+   pq_report(globals->queue, stderr, globals->program, lane_names);
+}
+
+static void
+report_tick(EvLoop *loop, EvTimer *t, void *arg)
+{
+   report_latency(loop, 0, arg);
+   ev_timer_set(t, globals->report_secs * 1000L);
+}
+
+static void
+ack_timeout(EvLoop *loop, EvTimer *t, void *arg)
+{
+   zsend_expire(globals->session);
+   arm_ack_timer();
+}
+
+static void
+zephyr_ready(EvLoop *loop, int fd, unsigned events, void *arg)
+{
+   zsend_receive(globals->session);
+   arm_ack_timer();
+}
+
+static void
+remove_client(Client *c)
+{
+   ev_remove(globals->loop, c->fd);
+   close(c->fd);
+   c->fd = -1;
+   if (c->prev != NULL)
+      c->prev->next = c->next;
+   else
+      globals->clients = c->next;
+   if (c->next != NULL)
+      c->next->prev = c->prev;
+   globals->nclients--;
+   client_unref(c);
+}
+
+static void
+accept_clients(EvLoop *loop, int lfd, unsigned events, void *arg)
+{
+   Client *c;
+   int fd;
+
+   while ((fd = accept(lfd, NULL, NULL)) >= 0) {
+      c = (Client *) calloc(1, sizeof(Client));
+      c->fd = fd;
+      c->refs = 1;
+      if (ev_add(loop, fd, EPOLLIN, read_client, c) < 0) {
+	 close(fd);
+	 free(c);
+	 continue;
+      }
+      c->next = globals->clients;
+      if (c->next != NULL)
+	 c->next->prev = c;
+      globals->clients = c;
+      globals->nclients++;
+   }
+}
+
+/* Read one submission from a client. */
+static void
+read_client(EvLoop *loop, int fd, unsigned events, void *arg)
+{
+   Client *c = (Client *) arg;
+   struct msghdr mh;
+   struct iovec iov;
+   ssize_t n;
+
+   if (!(events & EPOLLIN)) {
+      /* EPOLLHUP or EPOLLERR with nothing left to read */
+      remove_client(c);
+      return;
+   }
+   if (backlog() >= QUEUE_FACTOR * globals->max_inflight) {
+      c->paused = 1;
+      globals->npaused++;
+      ev_modify(loop, fd, 0);
+      return;
+   }
+
+   bzero((char *) &mh, sizeof(mh));
+   iov.iov_base = globals->packet;
+   iov.iov_len = MAX_SUBMISSION;
+   mh.msg_iov = &iov;
+   mh.msg_iovlen = 1;
+
+   n = recvmsg(fd, &mh, MSG_DONTWAIT);
+   if (n < 0) {
+      if (errno != EAGAIN && errno != EINTR)
+	 remove_client(c);
+      return;
+   }
+   if (n == 0) {
+      remove_client(c);
+      return;
+   }
+   if (mh.msg_flags & MSG_TRUNC) {
+      reply(c, ZERR_PKTLEN, NULL);
+      return;
+   }
+   handle_submission(c, globals->packet, n);
+}
+
+static int
+open_listener(const char *path)
+{
+   struct sockaddr_un addr;
+   int fd;
+
+   if (strlen(path) >= sizeof(addr.sun_path)) {
+      fprintf(stderr, "%s: socket path too long: %s\n", globals->program, path);
+      return -1;
+   }
+   if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0)) < 0) {
+      perror("socket");
+      return -1;
+   }
+   bzero((char *) &addr, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strcpy(addr.sun_path, path);
+   unlink(path);
+   if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+      perror(path);
+      close(fd);
+      return -1;
+   }
+   if (listen(fd, LISTEN_BACKLOG) < 0) {
+      perror("listen");
+      close(fd);
+      return -1;
+   }
+   return fd;
+}
+
+static void
+make_keys(void)
+{
+   globals->k_class = vmake_symbol_c("class");
+   globals->k_instance = vmake_symbol_c("instance");
+   globals->k_opcode = vmake_symbol_c("opcode");
+   globals->k_sender = vmake_symbol_c("sender");
+   globals->k_signature = vmake_symbol_c("signature");
+   globals->k_realm = vmake_symbol_c("realm");
+   globals->k_recipients = vmake_symbol_c("recipients");
+   globals->k_message = vmake_symbol_c("message");
+   globals->k_trace = vmake_symbol_c("trace");
+}
+
+static void
+stop(EvLoop *loop, int signo, void *arg)
+{
+   ev_stop(loop);
+}
+
+/* Open the zephyr port and watch it for acknowledgements. */
+static int
+open_session(void)
+{
+   Code_t retval;
+
+   if ((retval = zsend_open(&globals->session)) != ZERR_NONE) {
+      com_err(globals->program, retval, "while opening zephyr port");
+      return -1;
+   }
+   zsend_set_auth(globals->session, globals->authenticate);
+   if ((globals->ack_timer = ev_timer(globals->loop, ack_timeout,
+				      NULL)) == NULL ||
+       ev_add(globals->loop, zsend_fd(globals->session), EPOLLIN,
+	      zephyr_ready, NULL) < 0) {
+      perror("event loop");
+      return -1;
+   }
+   return 0;
+}
+
+static void
+worker_sent(ZSendSession *s, Code_t code, const char *recipient, void *arg)
+{
+   pool_worker_done(globals->worker, (unsigned) (unsigned long) arg, code,
+		    recipient);
+   sent_one();
+}
+
+static void
+worker_ready(EvLoop *loop, int fd, unsigned events, void *arg)
+{
+   char *data;
+   int len;
+   unsigned tag;
+
+   while (pool_worker_next(globals->worker, &data, &len, &tag))
+      submit_packet(data, len, worker_sent, (void *) (unsigned long) tag);
+}
+
+/* A worker sends what the supervisor puts in its ring, and nothing
+ * else; the supervisor's clients, spool and timers are not its own. */
+static void
+worker_main(PoolWorker *w)
+{
+   globals->worker = w;
+   globals->pool = NULL;
+   globals->queue = NULL;
+   globals->spool = NULL;
+   globals->clients = NULL;
+   globals->nclients = 0;
+   globals->inflight = 0;
+
+   /* the supervisor decides when to stop on ^C */
+   signal(SIGINT, SIG_IGN);
+   if ((globals->loop = ev_new()) == NULL ||
+       ev_signal(globals->loop, SIGTERM, stop, NULL) < 0 ||
+       open_session() < 0 ||
+       ev_add(globals->loop, pool_worker_fd(w), EPOLLIN, worker_ready,
+	      NULL) < 0)
+      exit(1);
+   if (ev_run(globals->loop) < 0)
+      perror("epoll_wait");
+   zsend_close(globals->session);
+}
+
+int main(int argc, char *argv[]) {
+   SpoolEntry *e;
+   int sw;
+
+   globals->program = strrchr(argv[0], '/');
+   if (globals->program == NULL)
+      globals->program = argv[0];
+   else
+      globals->program++;
+
+   globals->sync_batch = DEFAULT_SYNC_BATCH;
+   globals->sync_wait = DEFAULT_SYNC_WAIT;
+   globals->max_inflight = DEFAULT_MAX_INFLIGHT;
+
+   while ((sw = getopt(argc, argv, "adl:s:b:w:f:j:u:r:")) != EOF)
+      switch (sw) {
+       case 'a':
+	 globals->authenticate = 1;
+	 break;
+       case 'd':
+	 globals->debug = 1;
+	 break;
+       case 'l':
+	 globals->socket_path = optarg;
+	 break;
+       case 's':
+	 globals->spool_path = optarg;
+	 break;
+       case 'b':
+	 globals->sync_batch = atoi(optarg);
+	 break;
+       case 'w':
+	 globals->sync_wait = atoi(optarg);
+	 break;
+       case 'f':
+	 if ((globals->max_inflight = atoi(optarg)) < 1)
+	    globals->max_inflight = 1;
+	 break;
+       case 'j':
+	 globals->nworkers = atoi(optarg);
+	 break;
+       case 'u':
+	 globals->high_classes = (const char **)
+	    realloc(globals->high_classes,
+		    (globals->nhigh_classes + 1) * sizeof(char *));
+	 globals->high_classes[globals->nhigh_classes++] = optarg;
+	 break;
+       case 'r':
+	 globals->report_secs = atoi(optarg);
+	 break;
+       case '?':
+       default:
+	 usage(globals->program);
+	 exit(1);
+      }
+   if (globals->socket_path == NULL || optind != argc) {
+      usage(globals->program);
+      exit(1);
+   }
+
+   signal(SIGPIPE, SIG_IGN);
+   if ((globals->loop = ev_new()) == NULL ||
+       ev_signal(globals->loop, SIGINT, stop, NULL) < 0 ||
+       ev_signal(globals->loop, SIGTERM, stop, NULL) < 0 ||
+       ev_signal(globals->loop, SIGUSR1, report_latency, NULL) < 0) {
+      perror("event loop");
+      exit(1);
+   }
+
+   make_keys();
+   if ((globals->packet = (char *) malloc(MAX_SUBMISSION)) == NULL ||
+       (globals->queue = pq_new(NLANES, STARVE_RATIO)) == NULL) {
+      fprintf(stderr, "%s: out of memory\n", globals->program);
+      exit(1);
+   }
+
+   if (globals->nworkers > 0) {
+      if ((globals->pool = pool_start(globals->loop, globals->nworkers,
+				      worker_main)) == NULL) {
+	 perror("starting workers");
+	 exit(1);
+      }
+   }
+   else if (open_session() < 0)
+      exit(1);
+   if (globals->spool_path != NULL &&
+       (globals->spool = spool_open(globals->spool_path, globals->sync_batch,
+				    globals->sync_wait)) == NULL) {
+      perror(globals->spool_path);
+      exit(1);
+   }
+   if (globals->spool != NULL && spool_skipped(globals->spool) > 0)
+      fprintf(stderr, "%s: %s: passed over %d damaged records\n",
+	      globals->program, globals->spool_path,
+	      spool_skipped(globals->spool));
+   if ((globals->listen_fd = open_listener(globals->socket_path)) < 0)
+      exit(1);
+
+   globals->sync_timer = ev_timer(globals->loop, sync_spool, NULL);
+   globals->deliver_timer = ev_timer(globals->loop, deliver_ready, NULL);
+   globals->report_timer = ev_timer(globals->loop, report_tick, NULL);
+   if (globals->sync_timer == NULL || globals->deliver_timer == NULL ||
+       globals->report_timer == NULL ||
+       ev_add(globals->loop, globals->listen_fd, EPOLLIN, accept_clients,
+	      NULL) < 0) {
+      perror("event loop");
+      exit(1);
+   }
+   if (globals->report_secs > 0)
+      ev_timer_set(globals->report_timer, globals->report_secs * 1000L);
+
+   /* anything left over from last time */
+   if (globals->spool != NULL) {
+      for (e = spool_live(globals->spool); e != NULL; e = e->next)
+	 if (queue_entry(e) < 0) {
+	    fprintf(stderr, "%s: no memory to queue spooled notices\n",
+		    globals->program);
+	    exit(1);
+	 }
+      pump();
+   }
+
+   if (ev_run(globals->loop) < 0)
+      perror("epoll_wait");
+
+   unlink(globals->socket_path);
+   if (globals->debug)
+      report_latency(globals->loop, 0, NULL);
+   /* fails whatever is still in flight; spooled entries stay live */
+   if (globals->pool != NULL)
+      pool_stop(globals->pool);
+   zsend_close(globals->session);
+   if (globals->spool != NULL)
+      spool_close(globals->spool);
+   exit(0);
+}
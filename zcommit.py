@@ -1,18 +1,23 @@
 #!/usr/bin/python
 
 import cherrypy
-from flup.server.fcgi import WSGIServer
 import logging
 import json
+import optparse
 import os
-import subprocess
 import sys
+import time
 import traceback
 import dateutil.parser
 
+import jsonstream
+import zsendlib
+import ztrace
+
 HERE = os.path.abspath(os.path.dirname(__file__))
-ZWRITE = os.path.join(HERE, 'bin', 'zsend')
 LOG_FILENAME = 'logs/zcommit.log'
+# bytes of a streamed request body read at a time
+STREAM_CHUNK = 16384
 
 # Set up a specific logger with our desired output level
 logger = logging.getLogger(__name__)
@@ -23,6 +28,11 @@ handler = logging.FileHandler(LOG_FILENAME)
 logger.addHandler(handler)
 
 def zephyr(sender, klass, instance, zsig, msg):
+    trace = ztrace.current()
+    with trace.span('zephyr', klass=klass, instance=instance):
+        _zephyr(trace, sender, klass, instance, zsig, msg)
+
+def _zephyr(trace, sender, klass, instance, zsig, msg):
     # TODO: spoof the sender
     logger.info("""About to send zephyr:
 sender: %(sender)s
@@ -34,9 +44,38 @@ msg: %(msg)s""" % {'sender' : sender,
                    'instance' : instance,
                    'zsig' : zsig,
                    'msg' : msg})
-    cmd = [ZWRITE, '-S', sender, '-c', klass, '-i', instance,
-           '-s', zsig, '-d', '-m', msg]
-    subprocess.check_call([p.encode('utf-8') for p in cmd])
+    with trace.span('zsendd'):
+        zsendlib.client().send(klass.encode('utf-8'), instance.encode('utf-8'),
+                               msg.encode('utf-8'), sender=sender.encode('utf-8'),
+                               signature=zsig.encode('utf-8'), trace=trace)
+
+def format_commit(trace, c):
+    actions = []
+    if c.get('added'):
+        actions.extend('  A %s\n' % f for f in c['added'])
+    if c.get('removed'):
+        actions.extend('  D %s\n' % f for f in c['removed'])
+    if c.get('modified'):
+        actions.extend('  M %s\n' % f for f in c['modified'])
+    if not actions:
+        actions.append('Did not add/remove/modify any nonempty files.')
+    with trace.span('dateutil'):
+        timestamp = dateutil.parser.parse(c['timestamp']).strftime('%F %T %z')
+    with trace.span('format'):
+        info = {'name' : c['author']['name'],
+                'email' : c['author']['email'],
+                'message' : c['message'],
+                'timestamp' : timestamp,
+                'actions' : ''.join(actions),
+                'url' : c['url']}
+
+        return """%(url)s
+Author: %(name)s <%(email)s>
+Date:   %(timestamp)s
+
+%(message)s
+---
+%(actions)s""" % info
 
 class Application(object):
     @cherrypy.expose
@@ -78,13 +117,21 @@ any of the following optional key/value parameters:
     class Github(object):
         @cherrypy.expose
         def default(self, *args, **query):
+            trace = ztrace.start('github', path=cherrypy.request.path_info)
+            # the time CherryPy (and flup before it) took to get here
+            began = getattr(cherrypy.response, 'time', None)
+            if began is not None:
+                trace.add('dispatch', int(began * 1000000),
+                          int((time.time() - began) * 1000000))
             try:
-                return self._default(*args, **query)
+                return self._default(trace, *args, **query)
             except Exception, e:
                 logger.error('Caught exception %s:\n%s' % (e, traceback.format_exc()))
                 raise
+            finally:
+                trace.finish()
 
-        def _default(self, *args, **query):
+        def _default(self, trace, *args, **query):
             logger.info('A %s request with args: %r and query: %r' %
                         (cherrypy.request.method, args, query))
             opts = {}
@@ -97,9 +144,14 @@ any of the following optional key/value parameters:
             if 'class' not in opts:
                 raise cherrypy.HTTPError(400, 'Must specify a zephyr class name')
             logger.debug('Specified a class')
-            if cherrypy.request.method == 'POST':
+            if cherrypy.request.method == 'POST' and \
+                    not cherrypy.request.process_request_body:
+                self._stream(trace, opts)
+                msg = 'Thanks for posting!'
+            elif cherrypy.request.method == 'POST':
                 logger.debug('About to load data')
-                payload = json.loads(query['payload'])
+                with trace.span('json.loads', bytes=len(query['payload'])):
+                    payload = json.loads(query['payload'])
                 logger.debug('Loaded payload data')
                 zsig = payload['ref']
                 if 'zsig' in opts:
@@ -108,29 +160,7 @@ any of the following optional key/value parameters:
                 logger.debug('Set zsig')
                 for c in payload['commits']:
                     inst = opts.get('instance', c['id'][:8])
-                    actions = []
-                    if c.get('added'):
-                        actions.extend('  A %s\n' % f for f in c['added'])
-                    if c.get('removed'):
-                        actions.extend('  D %s\n' % f for f in c['removed'])
-                    if c.get('modified'):
-                        actions.extend('  M %s\n' % f for f in c['modified'])
-                    if not actions:
-                        actions.append('Did not add/remove/modify any nonempty files.')
-                    info = {'name' : c['author']['name'],
-                            'email' : c['author']['email'],
-                            'message' : c['message'],
-                            'timestamp' : dateutil.parser.parse(c['timestamp']).strftime('%F %T %z'),
-                            'actions' : ''.join(actions),
-                            'url' : c['url']}
-                    
-                    msg = """%(url)s
-Author: %(name)s <%(email)s>
-Date:   %(timestamp)s
-
-%(message)s
----
-%(actions)s""" % info
+                    msg = format_commit(trace, c)
                     zephyr(sender, opts['class'], inst, zsig, msg)
                 msg = 'Thanks for posting!'
             else:
@@ -138,10 +168,69 @@ Date:   %(timestamp)s
                        ' a zephyr to -c %s' % opts['class'])
             return msg
 
+        def _stream(self, trace, opts):
+            """With --stream, the payload is read off the socket a piece
+            at a time, and each commit is sent as soon as it has arrived,
+            while the rest of the body is still coming in.  The ref is
+            needed for the zsig, so commits that arrive before it wait
+            for it.  Unlike a whole-payload parse, a payload that turns
+            out to be bad after some commits still sends those."""
+            request = cherrypy.request
+            if request.headers.get('Content-Type', '').startswith(
+                    'application/json'):
+                field = None
+            else:
+                field = jsonstream.FormField('payload')
+            scanner = jsonstream.Scanner('commits')
+            sender = opts.get('sender', 'daemon.zcommit')
+            zsig = None
+            waiting = []
+            nbytes = 0
+            while True:
+                with trace.span('read'):
+                    chunk = request.body.read(STREAM_CHUNK)
+                nbytes += len(chunk)
+                if field is None:
+                    data = chunk
+                elif chunk:
+                    data = field.feed(chunk)
+                else:
+                    data = field.close()
+                try:
+                    with trace.span('json.loads', bytes=len(data)):
+                        events = scanner.feed(data)
+                except ValueError, e:
+                    raise cherrypy.HTTPError(400, 'Bad payload in its first '
+                                             '%d bytes: %s' % (nbytes, e))
+                for kind, key, value in events:
+                    if kind == 'member' and key == 'ref':
+                        zsig = value
+                        if 'zsig' in opts:
+                            zsig = '%s: %s' % (opts['zsig'], zsig)
+                        logger.debug('Set zsig')
+                    elif kind == 'item':
+                        inst = opts.get('instance', value['id'][:8])
+                        waiting.append((inst, format_commit(trace, value)))
+                    if zsig is not None:
+                        for inst, msg in waiting:
+                            zephyr(sender, opts['class'], inst, zsig, msg)
+                        waiting = []
+                if not chunk:
+                    break
+            if field is not None and not field.found:
+                raise cherrypy.HTTPError(400, 'No payload')
+            try:
+                scanner.close()
+            except ValueError:
+                raise cherrypy.HTTPError(400, 'Payload ended after %d bytes'
+                                         % nbytes)
+            if zsig is None:
+                raise cherrypy.HTTPError(400, 'Payload has no ref')
+
     github = Github()
 
-def main():
-    app = cherrypy.tree.mount(Application(), '/zcommit')
+def serve_fcgi(app):
+    from flup.server.fcgi import WSGIServer
     cherrypy.server.unsubscribe()
     cherrypy.engine.start()
     try:
@@ -149,5 +238,54 @@ def main():
     finally:
         cherrypy.engine.stop()
 
+def serve_http(addr, opts):
+    """Serve HTTP/1.1 directly on addr ([host:]port), without Apache
+    and FastCGI in front.  CherryPy's server keeps connections alive
+    between requests and runs them on a pool of worker threads."""
+    host, _, port = addr.rpartition(':')
+    cherrypy.config.update({'server.socket_host' : host or '0.0.0.0',
+                            'server.socket_port' : int(port),
+                            'server.thread_pool' : opts.threads,
+                            'server.socket_queue_size' : opts.backlog,
+                            'server.socket_timeout' : opts.idle_timeout,
+                            'server.max_request_header_size' : opts.max_header,
+                            'server.max_request_body_size' : opts.max_body,
+                            'engine.autoreload.on' : False,
+                            'log.screen' : False})
+    cherrypy.engine.signals.subscribe()
+    cherrypy.engine.start()
+    cherrypy.engine.block()
+
+def main():
+    parser = optparse.OptionParser(usage='%prog [options]')
+    parser.add_option('--http', metavar='[HOST:]PORT',
+                      help='serve HTTP directly instead of FastCGI on stdin')
+    parser.add_option('--threads', type='int', default=10,
+                      help='worker threads with --http')
+    parser.add_option('--backlog', type='int', default=128,
+                      help='listen queue length with --http')
+    parser.add_option('--idle-timeout', type='int', default=10,
+                      help='seconds a kept-alive connection may sit idle')
+    parser.add_option('--max-header', type='int', default=64 * 1024,
+                      help='largest request line and headers, in bytes')
+    parser.add_option('--max-body', type='int', default=4 * 1024 * 1024,
+                      help='largest request body, in bytes')
+    parser.add_option('--stream', action='store_true',
+                      default=bool(os.environ.get('ZCOMMIT_STREAM')),
+                      help='send each commit as soon as it has arrived '
+                      '(default $ZCOMMIT_STREAM)')
+    opts, args = parser.parse_args()
+    if args:
+        parser.error('unexpected arguments')
+    if opts.stream:
+        Application.Github._cp_config = {
+            'request.process_request_body' : False}
+
+    app = cherrypy.tree.mount(Application(), '/zcommit')
+    if opts.http:
+        serve_http(opts.http, opts)
+    else:
+        serve_fcgi(app)
+
 if __name__ == '__main__':
     sys.exit(main())
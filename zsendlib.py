@@ -0,0 +1,264 @@
+"""Ways to send notices without exec'ing bin/zsend.
+
+Session loads lib/libzsend.so (installed by 'make install' in
+src/zsend-0.0.1) with ctypes and sends through a long-lived session
+in this process.  Client submits notices to a resident zsendd over its
+Unix socket, which is the normal path for zcommit.py: zsendd owns the
+zephyr port, so any number of processes and threads can share it.
+Both have the same send() method.
+"""
+
+import ctypes
+import os
+import re
+import socket
+import threading
+
+HERE = os.path.abspath(os.path.dirname(__file__))
+LIBZSEND = os.path.join(HERE, 'lib', 'libzsend.so')
+ZSENDD_SOCKET = os.environ.get('ZSENDD_SOCKET',
+                               os.path.join(HERE, 'run', 'zsendd.sock'))
+
+class ZSendFields(ctypes.Structure):
+    # Must match struct ZSendFields in zsend.h
+    _fields_ = [('klass', ctypes.c_char_p),
+                ('instance', ctypes.c_char_p),
+                ('opcode', ctypes.c_char_p),
+                ('sender', ctypes.c_char_p),
+                ('signature', ctypes.c_char_p),
+                ('realm', ctypes.c_char_p),
+                ('message', ctypes.c_char_p),
+                ('message_len', ctypes.c_int)]
+
+class ZsendError(Exception):
+    def __init__(self, code, message, recipient=None):
+        Exception.__init__(self, code, message, recipient)
+        self.code = code
+        self.message = message
+        self.recipient = recipient
+
+    def __str__(self):
+        if self.recipient is not None:
+            return '%s (%d) while sending notice to %s' % (
+                self.message, self.code, self.recipient)
+        return '%s (%d)' % (self.message, self.code)
+
+def _load(path):
+    lib = ctypes.CDLL(path)
+    lib.zsend_default_fields.argtypes = [ctypes.POINTER(ZSendFields)]
+    lib.zsend_default_fields.restype = None
+    lib.zsend_open.argtypes = [ctypes.POINTER(ctypes.c_void_p)]
+    lib.zsend_open.restype = ctypes.c_int
+    lib.zsend_send.argtypes = [ctypes.c_void_p, ctypes.POINTER(ZSendFields),
+                               ctypes.c_int, ctypes.POINTER(ctypes.c_char_p)]
+    lib.zsend_send.restype = ctypes.c_int
+    lib.zsend_set_auth.argtypes = [ctypes.c_void_p, ctypes.c_int]
+    lib.zsend_set_auth.restype = None
+    lib.zsend_failed_recipient.argtypes = [ctypes.c_void_p]
+    lib.zsend_failed_recipient.restype = ctypes.c_char_p
+    lib.zsend_close.argtypes = [ctypes.c_void_p]
+    lib.zsend_close.restype = None
+    lib.error_message.argtypes = [ctypes.c_long]
+    lib.error_message.restype = ctypes.c_char_p
+    return lib
+
+class Session(object):
+    """A libzsend session.  libzephyr is not thread-safe, so sends are
+    serialized; open only one Session per process."""
+
+    def __init__(self, path=LIBZSEND, authenticate=False):
+        self._lib = _load(path)
+        self._lock = threading.Lock()
+        self._session = ctypes.c_void_p()
+        code = self._lib.zsend_open(ctypes.byref(self._session))
+        if code:
+            raise ZsendError(code, self._lib.error_message(code))
+        self._lib.zsend_set_auth(self._session, int(authenticate))
+
+    def send(self, klass, instance, message, sender=None, signature='',
+             opcode='', recipients=()):
+        fields = ZSendFields()
+        self._lib.zsend_default_fields(ctypes.byref(fields))
+        fields.klass = klass
+        fields.instance = instance
+        fields.opcode = opcode
+        fields.sender = sender
+        fields.signature = signature
+        fields.message = message
+        fields.message_len = len(message)
+        recips = (ctypes.c_char_p * (len(recipients) + 1))(*recipients)
+        self._lock.acquire()
+        try:
+            if self._session is None:
+                raise ZsendError(0, 'session is closed')
+            code = self._lib.zsend_send(self._session, ctypes.byref(fields),
+                                        len(recipients), recips)
+            if code:
+                raise ZsendError(code, self._lib.error_message(code),
+                                 self._lib.zsend_failed_recipient(self._session))
+        finally:
+            self._lock.release()
+
+    def close(self):
+        self._lock.acquire()
+        try:
+            if self._session is not None:
+                self._lib.zsend_close(self._session)
+                self._session = None
+        finally:
+            self._lock.release()
+
+def quote(s):
+    """s as an lread string literal."""
+    return '"%s"' % s.replace('\\', '\\\\').replace('"', '\\"')
+
+class Symbol(str):
+    """An lread symbol, as opposed to a string."""
+
+class Dotted(object):
+    """A list with a non-nil tail, like (a b . c)."""
+    def __init__(self, items, tail):
+        self.items = items
+        self.tail = tail
+
+VBIN_MAGIC = '\xb1'
+
+def _varint(n):
+    out = []
+    while n >= 0x80:
+        out.append(chr((n & 0x7f) | 0x80))
+        n >>= 7
+    out.append(chr(n))
+    return ''.join(out)
+
+def _encode(v, out):
+    if v is None:
+        out.append('\x00')
+    elif isinstance(v, (list, tuple, Dotted)):
+        items, tail = (v.items, v.tail) if isinstance(v, Dotted) else (v, None)
+        out.append('\x01' + _varint(len(items)))
+        for item in items:
+            _encode(item, out)
+        _encode(tail, out)
+    elif isinstance(v, str):
+        tag = isinstance(v, Symbol) and '\x03' or '\x02'
+        out.append(tag + _varint(len(v)) + v + '\0')
+    elif isinstance(v, (int, long)):
+        out.append('\x04' + _varint(v < 0 and (-v << 1) - 1 or v << 1))
+    else:
+        raise TypeError('cannot encode %r' % (v,))
+
+def encode(v):
+    """v in lread's binary encoding (see vencode() in lread.c).  Python
+    lists are lists, strs are strings and Symbols are symbols."""
+    out = []
+    _encode(v, out)
+    body = ''.join(out)
+    return VBIN_MAGIC + _varint(len(body)) + body
+
+_STATUS_RE = re.compile(r'\(status \. (-?\d+)\)')
+_FIELD_RE = re.compile(r'\((error|recipient) \. "((?:[^"\\]|\\.)*)"\)')
+_PHASE_RE = re.compile(r'\(([a-z]+) (\d+) (\d+)\)')
+_UNESCAPE_RE = re.compile(r'\\(.)', re.S)
+
+class Client(object):
+    """Submits notices to zsendd.  Each thread gets its own connection,
+    so concurrent sends from one process are not serialized here.  With
+    binary set, submissions use lread's binary encoding, which zsendd
+    decodes without copying; the default is printed s-expressions."""
+
+    MAX_REPLY = 1024
+
+    def __init__(self, path=ZSENDD_SOCKET, binary=False):
+        self.path = path
+        self.binary = binary
+        self._local = threading.local()
+
+    def _connection(self):
+        conn = getattr(self._local, 'conn', None)
+        if conn is None:
+            conn = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+            conn.connect(self.path)
+            self._local.conn = conn
+        return conn
+
+    def submit(self, submission):
+        """Send one printed submission and return zsendd's reply."""
+        conn = self._connection()
+        try:
+            conn.send(submission)
+            reply = conn.recv(self.MAX_REPLY)
+        except socket.error:
+            self._local.conn = None
+            conn.close()
+            raise
+        if not reply:
+            self._local.conn = None
+            conn.close()
+            raise ZsendError(0, 'zsendd closed the connection')
+        return reply
+
+    def send(self, klass, instance, message, sender=None, signature='',
+             opcode='', recipients=(), trace=None):
+        """With a ztrace Trace, zsendd is asked for its timings, which
+        are added to it as spans."""
+        fields = [('class', klass), ('instance', instance),
+                  ('opcode', opcode), ('signature', signature),
+                  ('message', message)]
+        if sender is not None:
+            fields.append(('sender', sender))
+        if trace is not None and trace.id is not None:
+            fields.append(('trace', trace.id))
+        if self.binary:
+            alist = [Dotted([Symbol(k)], v) for k, v in fields]
+            if recipients:
+                alist.append([Symbol('recipients')] + list(recipients))
+            submission = encode(alist)
+        else:
+            parts = ['(%s . %s)' % (k, quote(v)) for k, v in fields]
+            if recipients:
+                parts.append('(recipients %s)' % ' '.join(quote(r)
+                                                          for r in recipients))
+            submission = '(%s)' % ' '.join(parts)
+        reply = self.submit(submission)
+        if trace is not None and trace.id is not None:
+            i = reply.find('(trace ')
+            if i >= 0:
+                for name, ts, dur in _PHASE_RE.findall(reply, i):
+                    trace.add('zsendd.' + name, int(ts), int(dur),
+                              cat='zsendd')
+        m = _STATUS_RE.search(reply)
+        if m is None:
+            raise ZsendError(0, 'bad reply from zsendd: %r' % reply)
+        code = int(m.group(1))
+        if code:
+            extra = dict((k, _UNESCAPE_RE.sub(r'\1', v))
+                         for k, v in _FIELD_RE.findall(reply))
+            raise ZsendError(code, extra.get('error', 'unknown error'),
+                             extra.get('recipient') or None)
+
+_session = None
+_session_lock = threading.Lock()
+_client = None
+
+def session():
+    """The process-wide Session, opened on first use."""
+    global _session
+    _session_lock.acquire()
+    try:
+        if _session is None:
+            _session = Session()
+        return _session
+    finally:
+        _session_lock.release()
+
+def client():
+    """The process-wide zsendd Client."""
+    global _client
+    _session_lock.acquire()
+    try:
+        if _client is None:
+            _client = Client()
+        return _client
+    finally:
+        _session_lock.release()
@@ -0,0 +1,144 @@
+"""Per-request tracing, written as Chrome trace-event JSON.
+
+A sampled request gets a Trace, and each phase of handling it is
+wrapped in a span:
+
+    trace = ztrace.start('github')
+    try:
+        with trace.span('json.loads'):
+            payload = json.loads(...)
+    finally:
+        trace.finish()
+
+Requests that are not sampled get a NullTrace, whose spans cost next
+to nothing, so tracing can stay on in production.  ZCOMMIT_TRACE_SAMPLE
+is the fraction of requests to trace (default 0, off), and
+ZCOMMIT_TRACE_FILE where they go (default logs/trace.json).
+
+Spans are complete ('X') events on the request's process and thread,
+so the viewer nests them by time.  zsendd reports its own phases for
+a traced submission (see zsendlib.Client.send), and they are added
+the same way, inside the span around the send.  The file is a JSON
+array that is never closed, which chrome://tracing and Perfetto both
+accept; each finished request is appended with one write().
+"""
+
+import errno
+import json
+import os
+import random
+import thread
+import threading
+import time
+
+HERE = os.path.abspath(os.path.dirname(__file__))
+SAMPLE = float(os.environ.get('ZCOMMIT_TRACE_SAMPLE', '0'))
+TRACE_FILE = os.environ.get('ZCOMMIT_TRACE_FILE',
+                            os.path.join(HERE, 'logs', 'trace.json'))
+
+_local = threading.local()
+
+def _now_us():
+    return int(time.time() * 1000000)
+
+class _Span(object):
+    def __init__(self, trace, name, args):
+        self.trace = trace
+        self.name = name
+        self.args = args
+
+    def __enter__(self):
+        self.start = _now_us()
+        return self
+
+    def __exit__(self, *exc):
+        self.trace.add(self.name, self.start, _now_us() - self.start,
+                       **self.args)
+        return False
+
+class Trace(object):
+    """The spans of one sampled request."""
+
+    def __init__(self, name, **args):
+        self.id = '%016x' % random.getrandbits(64)
+        self.name = name
+        self.args = args
+        self.pid = os.getpid()
+        self.tid = thread.get_ident()
+        self.start = _now_us()
+        self.events = []
+
+    def span(self, name, **args):
+        """A context manager timing the code inside it."""
+        return _Span(self, name, args)
+
+    def add(self, name, ts, dur, cat='zcommit', **args):
+        """A span that was timed some other way; ts and dur are in
+        microseconds, ts since the epoch."""
+        args['trace'] = self.id
+        self.events.append({'name' : name, 'cat' : cat, 'ph' : 'X',
+                            'ts' : ts, 'dur' : dur, 'pid' : self.pid,
+                            'tid' : self.tid, 'args' : args})
+
+    def finish(self):
+        if getattr(_local, 'trace', None) is self:
+            _local.trace = None
+        self.add(self.name, self.start, _now_us() - self.start, **self.args)
+        data = ''.join(json.dumps(e) + ',\n' for e in self.events)
+        # a trace is not worth failing the request over
+        try:
+            try:
+                fd = os.open(TRACE_FILE, os.O_WRONLY | os.O_CREAT | os.O_EXCL,
+                             0644)
+                os.write(fd, '[\n')
+                os.close(fd)
+            except OSError, e:
+                if e.errno != errno.EEXIST:
+                    raise
+            fd = os.open(TRACE_FILE, os.O_WRONLY | os.O_APPEND)
+            try:
+                os.write(fd, data)
+            finally:
+                os.close(fd)
+        except OSError:
+            pass
+
+class _NullSpan(object):
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        return False
+
+class NullTrace(object):
+    """What an unsampled request gets: it records nothing."""
+
+    id = None
+    _span = _NullSpan()
+
+    def span(self, name, **args):
+        return self._span
+
+    def add(self, name, ts, dur, cat='zcommit', **args):
+        pass
+
+    def finish(self):
+        _local.trace = None
+
+_null = NullTrace()
+
+def start(name, sample=None, **args):
+    """Begin tracing a request, with probability sample (by default
+    ZCOMMIT_TRACE_SAMPLE), and make it this thread's current trace."""
+    if sample is None:
+        sample = SAMPLE
+    if sample > 0 and random.random() < sample:
+        trace = Trace(name, **args)
+    else:
+        trace = _null
+    _local.trace = trace
+    return trace
+
+def current():
+    """This thread's current trace; a NullTrace if there is none."""
+    return getattr(_local, 'trace', None) or _null